@@ -0,0 +1,32 @@
+#include <SavePower.h>
+
+// Channels sampled in turn, as MUX5:0 values : A0 is ADC7, A1 is ADC6 on the ATMega32u4
+const uint8_t channels[] = { 0x07, 0x06 };
+
+void setup()
+{
+  Serial1.begin(9600);
+
+  // Sample A0 and A1 with 2 bits of oversampling (16 conversions per result, 12-bit results)
+  SavePower.SetSamplingChannels(channels, 2, 2);
+}
+
+void loop() 
+{
+  uint16_t value;
+  uint8_t  channel;
+
+  // Take 8 results, every conversion is done in ADC Noise Reduction mode
+  SavePower.SampleBurst(8);
+
+  // Read the results back from the ring buffer
+  while (SavePower.ReadSample(value, channel))
+  {
+    Serial1.print(channel, HEX);
+    Serial1.print(" : ");
+    Serial1.println(value);
+  }
+  Serial1.flush();
+
+  SavePower.SleepFor(10000UL, MODE_POWER_DOWN);
+}
@@ -0,0 +1,29 @@
+#include <SavePower.h>
+
+// The log collects up to 256 bytes while USART1 is clock-gated
+static uint8_t log_storage[256];
+SavePowerLog Log(Serial1, log_storage, sizeof(log_storage), DOMAIN_USART1);
+
+void SerialInit()
+{
+  Serial1.begin(9600);
+}
+
+void setup()
+{
+  Serial1.begin(9600);
+  // USART1 forgets its settings while gated, the hook sets it up again before every burst
+  SavePower.SetReinitHook(DOMAIN_USART1, SerialInit);
+  // Drain at 192 bytes, when a line waited 1 minute, and before any sleep of 10s or more
+  Log.SetFlushPolicy(192, 60000UL, 10000UL);
+}
+
+void loop() 
+{
+  // Put your code here
+  Log.print("uptime ");
+  Log.println(millis());
+
+  // The lines are sent in bursts instead of keeping USART1 running between them
+  SavePower.SleepFor(2000UL, MODE_POWER_DOWN);
+}
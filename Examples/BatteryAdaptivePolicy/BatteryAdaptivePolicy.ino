@@ -0,0 +1,23 @@
+#include <SavePower.h>
+
+// Battery levels from the highest down : minimum VCC (mV), sleep multiplier, clock division factor, optional peripherals dropped
+const SavePowerVccPolicy policy[] = 
+{
+  { 3600, 1, 1, 0 },
+  { 3300, 2, 2, 0 },
+  { 3000, 4, 8, (1 << DOMAIN_TWI) }
+};
+
+void setup()
+{
+  // Measure VCC at most once every 10 minutes
+  SavePower.SetVccPolicy(policy, 3, 600000UL);
+}
+
+void loop() 
+{
+  // Put your code here
+
+  // Sleep for 1 minute, 2 or 4 minutes as the battery discharges
+  SavePower.AdaptiveSleepFor(60000UL, MODE_POWER_DOWN);
+}
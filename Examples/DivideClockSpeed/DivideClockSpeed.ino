@@ -4,6 +4,9 @@ void setup()
 { 
   // Divide clock speed by 2. Take note that you can divide it by any of these following factors: 2, 4, 8, 16, 32, 64, 128 or 256  
   SavePower.DivideClockSpeed(2);
+
+  // Or divide it while keeping millis(), Delay() and the USART1 baud rate right
+  // SavePower.ScaleClockSpeed(8);
 }
 
 void loop() 
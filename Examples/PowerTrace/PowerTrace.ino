@@ -0,0 +1,16 @@
+#include <SavePower.h>
+
+void setup()
+{
+  // Record every sleep, wake up, PRR and clock change from now on (the trace goes on after the last page flushed)
+  SavePower.StartTrace();
+}
+
+void loop() 
+{
+  // Put your code here
+
+  // Save the events of this loop to the next EEPROM page before the long sleep, they are read back with extras/TraceDecoder
+  SavePower.FlushTrace();
+  SavePower.SleepFor(60000UL, MODE_POWER_DOWN);
+}
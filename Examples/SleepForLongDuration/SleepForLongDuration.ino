@@ -0,0 +1,16 @@
+#include <SavePower.h>
+
+void setup()
+{
+  // Measure the real period of the Watchdog oscillator once, to correct the length of every sleep
+  SavePower.CalibrateWatchdog();
+}
+
+void loop() 
+{
+  // Put your code here
+
+  // Sleep for 5 minutes in Power Down mode. The duration is split into the fewest Watchdog periods, and the MCU goes straight 
+  // back to sleep after each of them without returning to loop()
+  SavePower.SleepFor(300000UL, MODE_POWER_DOWN);
+}
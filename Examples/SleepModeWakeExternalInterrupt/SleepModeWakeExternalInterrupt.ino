@@ -10,21 +10,24 @@ void setup()
 { 
   // Configure the interrupt pin 3 as input with pull-up resistor to read the digital input on pin 3
   pinMode(INTPIN, INPUT_PULLUP);
+
+  // Register the pin 3 (INT0 on the ATMega32u4) as wake up source once, it is armed only while the MCU sleeps
+  SavePower.AttachWakeSource(WAKE_INT0, ISR_function, LOW);
 }
 
 void loop() 
 { 
-  // Allow wake up pin to trigger interrupt whenever the pin changes value
-  attachInterrupt(digitalPinToInterrupt(INTPIN), ISR_function, HIGH);
-  
   // Enter the MCU into a sleep mode forever   
-  SavePower.IdleMode(SLEEP_FOREVER);
+  SavePower.PowerDownMode(SLEEP_FOREVER);
+  // SavePower.IdleMode(SLEEP_FOREVER);
   // SavePower.ADCNoiseReductionMode(SLEEP_FOREVER);
-  // SavePower.PowerDownMode(SLEEP_FOREVER);
   // SavePower.PowerSaveMode(SLEEP_FOREVER);
   // SavePower.StandbyMode(SLEEP_FOREVER);
   // SavePower.ExtendedStandbyMode(SLEEP_FOREVER);
 
-  // Turn off the interrupt 
-  detachInterrupt(digitalPinToInterrupt(INTPIN));
+  // Check which source woke the MCU up
+  if (SavePower.LastWakeCause() & (1 << WAKE_INT0))
+  {
+    // Put your wake up instructions here
+  }
 }
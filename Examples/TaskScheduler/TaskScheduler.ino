@@ -0,0 +1,37 @@
+#include <SavePower.h>
+
+uint8_t report_task;
+uint16_t last_reading;
+
+// Every 10s, allowed to run up to 2s late
+void ReadSensor()
+{
+  last_reading = analogRead(A0);
+}
+
+// Every 12s, shares the wake up of ReadSensor when both fall within the slack
+void SendReport()
+{
+  Serial1.begin(9600);
+  Serial1.println(last_reading);
+  Serial1.flush();
+}
+
+// A button on INT0 asks for a report right away
+void ButtonPressed()
+{
+  SavePower.ScheduleTask(report_task, millis());
+}
+
+void setup()
+{
+  SavePower.AddTask(ReadSensor, 10000UL, 2000, SavePowerClass::DomainMask(DOMAIN_ADC));
+  report_task = SavePower.AddTask(SendReport, 12000UL, 0, SavePowerClass::DomainMask(DOMAIN_USART1));
+  SavePower.AttachWakeSource(WAKE_INT0, ButtonPressed, FALLING);
+}
+
+void loop() 
+{
+  // Runs the tasks due, then sleeps in Power Down with every unused peripheral clock stopped
+  SavePower.RunTasks();
+}
@@ -52,9 +52,27 @@ PRR0    |  PRTWI  |  -  |  PRTIM0  |  -  |  PRTIM1  |  PRSPI  |  -  |  PRADC  |
 PRR1    |  PRUSB  |  -  |  -  |  PRTIM4  | PRTIM3  |  -  |  -  |  PRUSART1  |                              
          ------------------------------------------------------------------- 
 
+When several drivers share a peripheral (SPI and TWI often are), the Enable/Disable methods leave it to each driver to guess whether the 
+others still need it. Power domains count the users of each peripheral instead : AcquireDomain() and ReleaseDomain() only update a 
+reference count and the pending PRR0/PRR1 values, and CommitDomains() applies all of them with a single write per register, and only to 
+the bits of the peripherals ever acquired. The PowerGuard<...> template does all this for a scope, so the last user leaving its scope 
+gates the clock. Take note that the ADC is also disabled (ADEN) before its clock is stopped, and enabled again when it is powered up.
+
+The Enable and Disable methods of every peripheral are inline (SavePower.h) : each one is the PRR0 or PRR1 write itself, plus the 
+re-initialisation bookkeeping of the peripherals losing their state (see SetReinitHook() below). Disable<...>() and Enable<...>() do the 
+same for any list of peripherals given as Power_Domain_Value, with a single write per PRR register computed at compile time, for example 
+SavePower.Disable<DOMAIN_SPI, DOMAIN_TIMER1, DOMAIN_TIMER3>(). In the same way, Sleep<Mode, Time>() sleeps with the sleep mode and the 
+time-out value known at compile time, for example SavePower.Sleep<MODE_POWER_DOWN, WDTO_8S>() : it comes down to the Watchdog timed 
+sequence with a constant value (none at all with SLEEP_FOREVER, the default), one SMCR write and the sleep instruction, and the sketch 
+runs again right after the wake up interrupt. The Watchdog interrupt still adds the time slept to millis() and to the power statistics, 
+but the sources registered with AttachWakeSource() are not armed, LastWakeCause() is not updated, SetPLLSleepStop() is not applied, a 
+Watchdog tick ends a SLEEP_FOREVER sleep, the time slept after an early wake up is not added to millis(), and Idle is counted as active 
+time : the runtime methods below remain the ones to use for all of this.
+
 To reduce energy consumption of systems based on ATMega32u4/16u4, we can also divide the clock speed using the Clock Prescaler Register 
-CLKPR. To select between the nine available clock speeds, the control bit CLKPSE must always be written to logic one and the others must be 
-written as shown below :
+CLKPR. To select between the nine available clock speeds, a timed sequence must be followed : the control bit CLKPCE must first be written 
+to logic one alone (all other bits zero), then within four clock cycles, the CLKPS bits must be written as shown below with CLKPCE zero. 
+Interrupts are disabled during the sequence, otherwise the second write could miss its four cycles window and be ignored :
         
  ----------------------------------------------------------------------------------------------------------------------------
 |          CLKPS3          CLKPS2          CLKPS1          CLKPS0          Clock Division Factor          Frequency          |
@@ -71,6 +89,24 @@ written as shown below :
 |                                                         RESERVED                                                           |    
  ----------------------------------------------------------------------------------------------------------------------------        
 
+DivideClockSpeed() only changes the prescaler, so everything computed from F_CPU goes wrong : Timer0 ticks slower (millis(), micros() 
+and delay()), and the USART1 baud rate drops. ScaleClockSpeed() changes the prescaler and keeps them right. Timer0 prescaler is changed 
+so that Timer0 keeps its rate whenever possible (factors 1, 8 and 64), otherwise it runs 2 or 4 times slower and the missing time is added 
+back to millis() by Now() and by every further call to ScaleClockSpeed(). Delay() waits for real milliseconds at any factor. The USART1 
+baud rate register UBRR1 (and U2X1) is scaled to keep the same baud rate once the transmitter is idle, as far as the slower clock allows. 
+USB is not affected since the PLL is fed before the system clock prescaler. Take note that delayMicroseconds() is counted in CPU cycles 
+and will last Clock_Division_Factor times longer.
+
+The clock tree can be managed as well. SelectClockSource(CLOCK_RC) starts the internal 8MHz RC oscillator, waits for it (RCON), switches 
+the system clock to it (CLKS) and stops the crystal, SelectClockSource(CLOCK_EXTERNAL) does the opposite (EXTON). The RC oscillator wakes 
+up from Power Down in a few cycles instead of the 16K cycles of the crystal, and draws less current, but it is only accurate to a few 
+percent and USB needs the crystal : the switch is refused while USB runs. On a 16MHz board the RC runs at half speed, the same scaling 
+as ScaleClockSpeed() applies (millis(), Delay() and the USART1 baud rate stay right), and the division factor asked to ScaleClockSpeed() 
+is kept whenever the RC allows it. The PLL (USB, and Timer4 when clocked from it) keeps running and drawing current in Idle : StopPLL() 
+and StartPLL() stop it and restart it waiting for its lock (PLOCK), and SetPLLSleepStop(true) does so around every sleep when USB does not 
+run. GetClockLatency() reports the measured PLL lock time and the start-up time of the RC oscillator and of the crystal, to choose between 
+a faster wake up and a lower current on purpose.
+
 For waking up the MCU from any of the sleep modes just by the software itself, we can count on the Watchdog Timer (WDT). This last one is 
 a timer counting cycles of a separate on-chip 128kHz oscillator. It can give an interrupt to wake the MCU from sleep modes when the counter 
 reaches a given time-out value. The Watchdog Timer Control Register WDTCSR allows us to select the operating mode and the time-out value we 
@@ -98,6 +134,186 @@ WDTCSR    |  WDIF  |  WDIE  |  WDP3  |  WDCE  |  WDE  |  WDP2  |  WDP1  |  WDP0
 |                                         RESERVED                                                    |    
  -----------------------------------------------------------------------------------------------------
 
+The single time-out values above are not enough for sleeping minutes at a time, and looping over them in the sketch costs a full wake up 
+and return to loop() for each period. SleepFor(ms, mode) splits any duration into the fewest Watchdog periods (largest first) and re-arms 
+the Watchdog from inside its own interrupt, so the MCU goes straight back to sleep without returning to the sketch. The 128kHz oscillator 
+is not accurate (it depends on voltage and temperature), so CalibrateWatchdog() measures its real period against the system clock and the 
+resulting factor (1024 means nominal) is used to correct the length of every period. SetWatchdogCalibration() restores a stored factor.
+
+The Watchdog can not sleep less than 16ms, and its oscillator is not accurate. For the shorter gaps, SleepMicros(us) counts the time with 
+the compare match B of a 16-bit timer instead : Timer3 by default (OC3B is not connected to any pin of the ATMega32u4), or Timer1 when 
+SAVEPOWER_MICROS_TIMER is defined as 1. The timer is programmed in normal mode with the smallest prescaler holding the duration (longer 
+durations are split), the MCU enters Idle mode with the clock of every other peripheral gated in PRR0/PRR1 but USB, USART1 and the power 
+domains passed along (SleepUntil() passes the ones its constraints need), and the timer and the power state are restored afterwards. 
+Other interrupts are served and the MCU goes back to sleep until the compare match. Timer0 is gated as well, so the time slept is added 
+back to millis(). SleepUntil() uses it for the last milliseconds before its deadline. Take note that the PWM outputs and tone() of the 
+timer pause meanwhile, and that SleepMicros() can not be used when another library defines the compare match B vector of the timer (it 
+is defined weak).
+
+The Watchdog is only ever armed in interrupt mode (WDE = 0), through the WDCE timed sequence with WDRF cleared first, so staying awake past 
+a time-out can not reset the MCU. It stops itself from its interrupt at the end of the period it was armed for. When the MCU is woken early 
+by another source, the period is left running in interrupt mode to measure the time slept (see below), and stops at its end. On top of 
+this, StartWatchdogTick(period, ticks, callback) turns the Watchdog into a cheap periodic system tick : the hardware repeats the period on 
+its own, the callback is called from the interrupt every ticks periods, and a sleep method called with SLEEP_FOREVER goes straight back 
+to sleep after a tick instead of returning to the sketch. The timed sleep methods, SleepFor() and CalibrateWatchdog() borrow the Watchdog 
+and the tick starts again once they give it back, its counter keeps the ticks already counted. StopWatchdogTick() ends it.
+
+Every sleep method also feeds an energy accounting : the time spent active and in each sleep mode, and the number of wakes per source. 
+The Watchdog interrupt adds its period to the residency of the deep sleep modes (Timer0 and millis() are stopped there), while Idle and 
+active time are measured with millis(). GetPowerStats() returns a snapshot of these counters, along with a charge estimate in uAh computed 
+from a per mode current table. The default table below holds typical values of an ATMega32u4 at 5V/16MHz with the Watchdog running, and 
+should be replaced by values measured on the real board with SetModeCurrent().
+
+ ------------------------------------------------------
+| Mode                                  Current        | 
+ ------------------------------------------------------
+| Active                                10 mA          |
+| Idle                                  4 mA           |
+| ADC Noise Reduction                   1.5 mA         |
+| Power Down / Power Save               10 uA          |
+| Standby / Extended Standby            300 uA         |
+ ------------------------------------------------------
+
+In all sleep modes but Idle, clkIO is halted and Timer0 stops, so millis() and micros() lose the whole time slept. The library adds the 
+Watchdog period back to the Arduino core timekeeping each time the Watchdog wakes the MCU. When another interrupt wakes the MCU before 
+the end of the period, the Watchdog keeps counting, and its interrupt only adds the slept part (period - time spent awake, Timer0 has 
+counted the rest). When the Watchdog is re-armed or stopped first, half of what is left of the period is added instead, and SleepMicros(), 
+ReadVcc() and SampleBurst(), which add their own sleep, stop it first. A part worked out while the sketch runs is added at the next sleep 
+(or the next method borrowing the Watchdog), so millis() never jumps while the sketch measures an interval. Now() returns this corrected clock in milliseconds. Sleeps without any time-out value 
+(SLEEP_FOREVER) cannot be measured and are not added.
+
+Instead of choosing a sleep mode by hand, SleepUntil(deadline, constraints) picks the deepest mode whose kept clocks cover the given 
+constraints and whose wake up latency fits the time left before the deadline (a Now() value). It sleeps there by chaining Watchdog periods, 
+then waits the last milliseconds in Idle, timed by SleepMicros(). With NEED_TIMERS, which SleepMicros() would break by stopping its timer 
+and gating Timer0, the Idle sleep is woken by every Timer0 tick instead and leaves every timer running. The mode table below is generated at compile time from F_CPU and 
+SAVEPOWER_OSC_STARTUP_CK, the start-up time of the oscillator selected by the CKSEL/SUT fuses (16K CK by default, as with the fuses of 
+Arduino boards running on a crystal) :
+
+ --------------------------------------------------------------------------------------------------------------------
+| Mode                    Constraints kept                                              Wake Up Latency              |
+ --------------------------------------------------------------------------------------------------------------------
+| Power Down              NEED_TWI_ADDRESS                                              SAVEPOWER_OSC_STARTUP_CK     |
+| Standby                 NEED_TWI_ADDRESS, NEED_OSCILLATOR                             6 CK                         |
+| ADC Noise Reduction     NEED_TWI_ADDRESS, NEED_OSCILLATOR, NEED_ADC                   6 CK                         |
+| Idle                    All of them (USART1, Timers, SPI and USB need clkIO/clkUSB)   6 CK                         |
+ --------------------------------------------------------------------------------------------------------------------
+
+SaveState() and RestoreState() save and restore PRR0, PRR1, ADCSRA, ADCSRB, ADMUX, ACSR and DIDR0-2 as they are, instead of forcing 
+every peripheral on or off. LowestConsumption() uses them, so the ADC and the Analog Comparator are only enabled on wake up if they were 
+enabled before, and EnableAllModules() restores the PRR0/PRR1 values saved by the last DisableAllModules() rather than powering everything. 
+TWI, SPI and USART1 (and USB) lose their state while their clock is stopped, so a re-initialisation function can be registered for them 
+with SetReinitHook(). It is not called on every wake up, but lazily, the first time the peripheral is powered up again (by its Enable 
+method, EnableAllModules() or a power domain) after the library stopped it.
+
+The supply voltage is measured by ReadVcc() without any external part : the ADC converts the internal bandgap (1.1V, SAVEPOWER_BANDGAP_MV 
+to use a value measured on the board) against AVcc, and VCC = bandgap * 1024 / result. Only two conversions are made, in ADC Noise 
+Reduction mode, the first one giving the bandgap the time to settle. SetVccPolicy(table, count, cadence_ms) gives a table of battery 
+levels, each with a sleep multiplier, a clock division factor and a mask (1 << Power_Domain_Value) of the optional peripherals to drop, 
+sorted from the highest level down :
+
+  const SavePowerVccPolicy policy[] = { { 3600, 1, 1, 0 }, { 3300, 2, 2, 0 }, { 3000, 4, 8, (1 << DOMAIN_TWI) } };
+
+UpdateVccPolicy() measures VCC only when cadence_ms elapsed since the last measurement, and applies the entry matching it when it changes : 
+the clock with ScaleClockSpeed(), and the optional peripherals through the power domains, the policy holding one reference on each of 
+them until it drops it (they stay powered while another user holds them). AdaptiveSleepFor(ms, mode) updates the policy and sleeps with 
+SleepFor() for ms times the sleep multiplier. The entry used is returned, and the last entry applies below the lowest level.
+
+An unconnected input pin floats, and an input buffer sitting at mid-rail (an analog signal) draws current in every sleep mode : on most 
+boards this leakage costs more than the ADC and the Analog Comparator together. SetPinSleepPolicy(pin, policy) declares, once, what each 
+pin becomes during a sleep : PIN_OUTPUT_LOW, PIN_PULLUP, or PIN_ANALOG (input without pull-up, with its digital input buffer disabled in 
+DIDR0, DIDR1 or DIDR2 when the pin has one : ADC0-13 and AIN0). ApplyPinSleepPlan() saves DDR and PORT of PORTB to PORTF and applies the 
+whole plan with one pass over the ports, touching only the ports holding planned pins, and RestorePinState() puts everything back in one 
+pass after wake up. LowestConsumption() does both around its sleep. Pins are given by their Arduino number. Take note that the pins of 
+the peripherals still used during the sleep (USB, the UART receiving, the wake up interrupts) must be left PIN_KEEP.
+
+ADC Noise Reduction mode exists to convert with the CPU and clkI/O stopped, which is both quieter and cheaper than the busy wait of 
+analogRead(). SetSamplingChannels(channels, count, oversampling_bits) gives the list of channels to sample in turn, as MUX5:0 values 
+(0x00-0x07 ADC0-7, 0x20-0x25 ADC8-13, 0x1E bandgap, 0x27 temperature sensor). SampleBurst(results) then takes that many results, each 
+conversion being started by entering ADC Noise Reduction mode and ending with the ADC_vect interrupt waking the MCU up. With oversampling, 
+each result is the sum of 4^n conversions of the same channel decimated by 2^n, giving 10+n bits (n up to 3). The results go into a single 
+producer (ADC_vect) single consumer (SamplesAvailable() and ReadSample()) ring buffer of SAVEPOWER_ADC_BUFFER entries (a power of two up to 256), 
+without disabling interrupts. The ADC is powered up for the burst, the digital input buffers of the sampled pins are disabled, and the 
+previous state is restored when it ends. Take note that :
+  ===> The reference is SAVEPOWER_ADC_REFERENCE, AVcc by default.
+  ===> The time slept during the conversions is added back to millis(), and accounted as ADC Noise Reduction residency.
+  ===> Results arriving when the ring buffer is full are dropped, SampleBurst() returns the number of results stored.
+  ===> ADC_vect is defined weak, so a sketch or another library defining it takes precedence, SampleBurst() can not be used then.
+  ===> ADC_vect reaches the engine through a hook set by SetSamplingChannels(), so the ring buffer (3 bytes per entry of SRAM) is only 
+       linked into the sketches sampling with it.
+
+The wake up sources can be registered once with AttachWakeSource(source, callback, mode) instead of being attached and detached around 
+every sleep : INT0-3 and INT6 (mode is LOW, CHANGE, FALLING or RISING), the pin change interrupts PCINT0-7 (mode is the PCMSK0 mask of 
+the pins), the Watchdog and the USB resume, and AttachWakeSource(port, callback) registers the reception of a serial port (Serial1) as 
+WAKE_USART1. All the registered sources are armed at once just before sleep_cpu(), with their pending flags cleared, and disarmed at once 
+on wake up, so they cost nothing while the MCU is awake. The external interrupts also disarm themselves in their interrupt, so a level 
+interrupt held low does not keep firing. LastWakeCause() returns the bitmask (1 << Wake_Source_Value) of the sources which woke the MCU, 
+filled in by the interrupts. A registered source also ends SleepFor() early. 
+Take note that :
+  ===> INT0-3 and INT6 go through attachInterrupt() of the Arduino core, which owns their vectors.
+  ===> PCINT0_vect is defined weak, so a library defining it (SoftwareSerial) takes precedence, and the wake up is then not attributed.
+  ===> The USB and USART1 vectors belong to the Arduino core. A USB resume is recognized from the core switching back from the WAKEUPE to 
+       the SUSPE interrupt, and a wake up nobody claimed is attributed to USART1 only when the port received bytes during the sleep (a 
+       Timer0 tick in Idle is not a reception). The callbacks of these two sources are called after wake up instead of from an interrupt.
+
+When the host suspends the USB bus (its laptop going to sleep), the device must draw less than 2.5mA, but the core of Arduino only swaps 
+the SUSPE and WAKEUPE interrupts in its USB_GEN_vect, and keeps the USB clock, the PLL and the CPU running all night. UsbSuspended() tells 
+whether the bus is suspended, from the WAKEUPE interrupt the core enables on suspend. SleepWhileUsbSuspended() then freezes the USB clock 
+(FRZCLK), stops the PLL and keeps the MCU in Power Down mode until the bus resumes : the WAKEUPI interrupt is asynchronous and wakes the 
+MCU up, the core switches back to SUSPE, and the PLL is restarted and locked (PLOCK) before the USB clock is unfrozen, within about a 
+millisecond, far less than the 20ms of resume signalling of the host. The device stays enumerated. It returns false right away when the 
+bus is not suspended, and also returns, with the USB clock running again, when a source registered with AttachWakeSource() wakes the MCU 
+up. The Watchdog wakes the MCU every 8s to keep millis() right, or the periodic Watchdog tick when it runs.
+
+Logging over USART1 or USB byte by byte keeps the port clocked and the CPU awake between the bytes. A SavePowerLog is a Print (print(), 
+println() and write() all work) collecting the output in a RAM buffer given by the sketch, with the port clock-gated, and draining it in 
+a single burst : Flush() powers the port up through its power domain (DOMAIN_USART1 or DOMAIN_USB), sends the buffer in at most two 
+writes, waits for the end of the transmission (flush() of the port) and releases the domain, which gates the port again unless another 
+user holds it. SetFlushPolicy(threshold, max_delay_ms, long_sleep_ms) sets when this happens : once threshold bytes are pending (3/4 of 
+the buffer by default), once the oldest byte waited max_delay_ms (no deadline by default), and just before any sleep of long_sleep_ms or 
+more (1s by default) or a sleep the oldest byte would miss its deadline in. The sleep methods of the library check the registered log 
+buffers (SAVEPOWER_LOG_BUFFERS of them, 2 by default, Registered() tells whether the log got a slot, and a log going out of scope gives 
+it back) on their own, and a full buffer is drained before it takes more bytes. Poll() checks the threshold and the deadline outside of 
+the writes. Take note that :
+  ===> USART1 loses its state while gated : register a hook calling Serial1.begin() with SetReinitHook(DOMAIN_USART1, ...).
+  ===> The port must only be written through the log, its clock is stopped the rest of the time.
+  ===> Gating USB drops the device from the bus, so a sketch staying enumerated holds DOMAIN_USB with AcquireDomain() : the log then 
+       saves the wake ups and sends full packets. Nothing is sent while the bus is suspended, the data waits for the resume.
+  ===> Sleep<>() does not check the log buffers.
+
+Working out why a unit in the field drained its battery early usually takes a scope. StartTrace() starts recording a power trace instead 
+: every sleep (with its mode), every wake up (with its causes), every new PRR0, PRR1 and clock division value, and the start of the trace 
+itself (with the reset flags of MCUSR), each one as an event of 6 bytes time-stamped with millis(). PRR and clock changes are seen by the 
+library methods changing them and by every sleep, so a change made by an inline Enable/Disable method is time-stamped at the next sleep. 
+The events go into a RAM ring buffer of SAVEPOWER_TRACE_EVENTS entries (16 by default, a power of two), where ReadTraceEvent() can take 
+them to be sent over a serial link, or FlushTrace() writes them to EEPROM. The EEPROM area (SAVEPOWER_TRACE_PAGES pages of 
+SAVEPOWER_TRACE_PAGE_SIZE bytes from SAVEPOWER_TRACE_EEPROM_START, by default the upper half of the EEPROM in pages of 64 bytes : 8 pages 
+from 512 on the ATMega32u4, 4 pages from 256 on the ATMega16u4) is used as a circular log of pages, each one holding a sequence number, 
+up to 9 events, the number of events lost before them and a checksum. Every flush writes the next page, so the wear is spread evenly over 
+all of them, the header is written last so a flush cut by a reset leaves an invalid page rather than a wrong one, and StartTrace() goes 
+on after the page with the latest sequence number. ClearTrace() invalidates all the pages. The host tool in extras/TraceDecoder decodes a 
+dump of the EEPROM into the timeline, the residency in each mode and the estimated charge. 
+Take note that :
+  ===> Writing a page takes up to 3.4ms per byte changed, so FlushTrace() is best called just before a long sleep, often enough to not 
+       let the RAM buffer overwrite its oldest events (they are counted as lost).
+  ===> Sleep<>() is not traced, and the wake up from SleepMicros() is recorded as TRACE_WAKE_TIMER.
+  ===> The EEPROM area must not be used by the sketch.
+
+A sketch made of periodic jobs (read a sensor every 10s, send a report every minute) can hand its loop() to the cooperative scheduler. 
+AddTask() registers a function with its period, its slack (how late it may run) and the power domains it uses, ScheduleTask() sets the 
+next run of a task (a period of 0 makes a one shot task) and RemoveTask() frees its slot. RunTasks(), called as the whole loop(), runs 
+every task that is due, then sleeps until the earliest due time plus slack : the tasks due inside that window run on the same wake up, 
+so two tasks with close periods share their wake ups instead of doubling them. The sleep itself goes through the SleepUntil() governor, 
+in the deepest mode the constraints of the remaining tasks allow, on the Watchdog for the long part and on Timer3 for the last 
+milliseconds. Between two runs, every power domain but Timer0 (and USB while it runs) is gated, each task gets its domains on for the 
+time of its run only, and the domains the constraints of a task need during the sleep (NEED_USART1, NEED_SPI, ...) are kept on. 
+Take note that :
+  ===> A peripheral used outside of the tasks must be held with AcquireDomain(), or the scheduler stops its clock.
+  ===> A wake up from a source registered with AttachWakeSource() ends the sleep, RunTasks() then returns to let loop() handle it. 
+       The sources are only armed in the Watchdog part of the sleep : the Idle part (the whole sleep when the constraints only allow 
+       Idle, as with NEED_USART1) runs to the deadline, the sources firing meanwhile are seen at the next RunTasks().
+  ===> ScheduleTask() may be called from an interrupt handler, for instance to run a task on an external event.
+  ===> With no task scheduled, RunTasks() sleeps forever in the deepest allowed mode, until a wake source or an interrupt fires.
+
 * Please Note:
   ===> Standby modes are only recommended for use with external crystals or resonators.
   ===> If the Analog Digital Converter (ADC) is enabled before entering to any of sleep modes. It will be enabled in all sleep modes. It 
@@ -122,347 +338,2212 @@ WDTCSR    |  WDIF  |  WDIE  |  WDP3  |  WDCE  |  WDE  |  WDP2  |  WDP1  |  WDP0
   #include <avr/sleep.h>
   #include <avr/wdt.h>
   #include <avr/interrupt.h>
+  #include <avr/eeprom.h>
+#elif defined (SAVEPOWER_HOST_EMULATION)
+  // avr/sleep.h, avr/wdt.h, avr/interrupt.h and avr/eeprom.h are provided by SavePowerEmulation.h
 #else
   #error "These libraries support only AVR family of microcontrollers."
 #endif
 
 #if defined (__AVR_ATmega32U4__) || defined (__AVR_ATmega16U4__) 
 
- // Dividing Clock System Frequency 
- // Clock Division Factor = 2
- #ifndef DivideClockSpeedByTwo          
-  #define DivideClockSpeedByTwo() {   \
-  	 CLKPR = 0x81;                \
-  } 									
- #endif
- 
- // Clock Division Factor = 4
- #ifndef DivideClockSpeedByFour          
-  #define DivideClockSpeedByFour() {   \
-  	 CLKPR = 0x82;                 \
-  } 									
- #endif
- 
- // Clock Division Factor = 8
- #ifndef DivideClockSpeedByEight          
-  #define DivideClockSpeedByEight() {   \
-  	 CLKPR = 0x83;                  \
-  } 									
- #endif
- 
- // Clock Division Factor = 16
- #ifndef DivideClockSpeedBySixteen          
-  #define DivideClockSpeedBySixteen() {   \
-  	 CLKPR = 0x84;                    \
-  } 									
- #endif
-
- // Clock Division Factor = 32
- #ifndef DivideClockSpeedByThirtyTwo          
-  #define DivideClockSpeedByThirtyTwo() {   \
-  	 CLKPR = 0x85;                      \
-  } 									
- #endif
- 
- // Clock Division Factor = 64
- #ifndef DivideClockSpeedBySixtyFour          
-  #define DivideClockSpeedBySixtyFour() {   \
-  	 CLKPR = 0x86;                      \
-  } 									
- #endif 
- 
- // Clock Division Factor = 128
- #ifndef DivideClockSpeedByOneHundredTwentyEight          
-  #define DivideClockSpeedByOneHundredTwentyEight() {   \
-  	 CLKPR = 0x87;                                  \
-  } 									
- #endif
- 
- // Clock Division Factor = 256 
- #ifndef DivideClockSpeedByTwoHundredFiftySix          
-  #define DivideClockSpeedByTwoHundredFiftySix() {   \
-  	 CLKPR = 0x88;                               \
-  } 									
- #endif
- 
- // Default State (8 MHz)
- #ifndef ClockSpeedDefaultState          
-  #define ClockSpeedDefaultState() {   \
-  	 CLKPR = 0x00;                 \
-  } 									
- #endif
- 
- // Analog Comparator ACSR bit
- #ifndef ACD
-  #define ACD 7
- #endif
- 
- // Analog Comparator power reduction macros
- #ifndef disable_ac          
-  #define disable_ac() {       \
-  	 ACSR |= (1 << ACD);   \
-  } 									
+ // 16-bit timer of SleepMicros(), Timer3 by default (OC3B has no pin), and the clocks gated while it runs
+ #ifndef SAVEPOWER_MICROS_TIMER
+  #define SAVEPOWER_MICROS_TIMER 3
  #endif
 
- #ifndef enable_ac          
-  #define enable_ac() {         \
-  	 ACSR &= ~(1 << ACD);   \
-  } 									
- #endif
- 
- // Timer4 PRR bit 
- #ifndef PRTIM4
-  #define PRTIM4 4
+ #if SAVEPOWER_MICROS_TIMER == 1
+  #define MICROS_TCCRA       TCCR1A
+  #define MICROS_TCCRB       TCCR1B
+  #define MICROS_TCNT        TCNT1
+  #define MICROS_OCRB        OCR1B
+  #define MICROS_TIMSK       TIMSK1
+  #define MICROS_TIFR        TIFR1
+  #define MICROS_OCIEB       OCIE1B
+  #define MICROS_OCFB        OCF1B
+  #define MICROS_COMPB_vect  TIMER1_COMPB_vect
+  #define MICROS_TIMER_PRR0  (1 << PRTIM1)
+  #define MICROS_TIMER_PRR1  0
+  #define MICROS_GATED_PRR0  ((1 << PRTWI) | (1 << PRTIM0) | (1 << PRSPI) | (1 << PRADC))
+  #define MICROS_GATED_PRR1  ((1 << PRTIM4) | (1 << PRTIM3))
+ #else
+  #define MICROS_TCCRA       TCCR3A
+  #define MICROS_TCCRB       TCCR3B
+  #define MICROS_TCNT        TCNT3
+  #define MICROS_OCRB        OCR3B
+  #define MICROS_TIMSK       TIMSK3
+  #define MICROS_TIFR        TIFR3
+  #define MICROS_OCIEB       OCIE3B
+  #define MICROS_OCFB        OCF3B
+  #define MICROS_COMPB_vect  TIMER3_COMPB_vect
+  #define MICROS_TIMER_PRR0  0
+  #define MICROS_TIMER_PRR1  (1 << PRTIM3)
+  #define MICROS_GATED_PRR0  ((1 << PRTWI) | (1 << PRTIM0) | (1 << PRTIM1) | (1 << PRSPI) | (1 << PRADC))
+  #define MICROS_GATED_PRR1  (1 << PRTIM4)
  #endif
+ // Longest duration turned into timer cycles at once, one round of the slowest prescaler at the undivided clock
+ #define MICROS_CHUNK_US ((0xFFFFUL << 10) / (F_CPU / 1000000UL))
+ // Longest Idle sleep SleepUntil() asks SleepMicros() for at once, so the microseconds stay within 32 bits
+ #define SLEEP_UNTIL_MICROS_MAX_MS 4000000L
   
  #ifndef EnterSleepMode            
   #define EnterSleepMode(mode) {   \
      do {   	                   \
           set_sleep_mode(mode);    \
           cli();  	           \
+          WakeSourcesArm();        \
           sleep_enable();          \
           sei();		   \
           sleep_cpu();	           \
           sleep_disable();         \
+          WakeSourcesDisarm();     \
           sei();		   \
         } while (0);	           \
   }	
  #endif		  					
 
-// Dividing Clock Speed Method
-void SavePowerClass::DivideClockSpeed(int Clock_Division_Factor)
+
+ // Watchdog period index used when no period fits the requested duration
+ #ifndef WDT_NO_PERIOD
+  #define WDT_NO_PERIOD 0xFF
+ #endif
+
+// SMCR sleep mode bits indexed by Sleep_Mode_Value
+static const uint8_t sleep_mode_bits[] = { SLEEP_MODE_IDLE, SLEEP_MODE_ADC, SLEEP_MODE_PWR_DOWN, 
+                                           SLEEP_MODE_PWR_SAVE, SLEEP_MODE_STANDBY, SLEEP_MODE_EXT_STANDBY };
+
+// Real length in ms of every Watchdog period (16ms << index at 128kHz), corrected by the calibration factor
+static uint16_t wdt_period_ms[] = { 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192 };
+static uint16_t wdt_calibration = 1024;
+
+// State shared with the inline methods of SavePower.h : current sleep mode, armed Watchdog period and tick, stale power domains
+SavePowerCoreState savepower_core = { MODE_ACTIVE, WDT_NO_PERIOD, 0, 0, 0 };
+
+// SleepFor chain state, shared with the Watchdog interrupt
+static volatile uint32_t sleep_remaining_ms;
+static volatile uint8_t  sleep_chaining;
+static volatile uint8_t  wdt_fired;
+
+// Periodic Watchdog tick : period, callback called every wdt_tick_every periods, and whether the Watchdog runs the tick right now
+static void     (*wdt_tick_callback)();
+static uint16_t wdt_tick_every;
+static volatile uint16_t wdt_tick_count;
+static volatile uint8_t  wdt_tick_period;
+static volatile uint8_t  wdt_ticking;
+
+// Energy accounting, the deep sleep residency and the Watchdog wakes are updated from the Watchdog interrupt
+static SavePowerStats   power_stats;
+static uint32_t         active_since_ms;
+static uint16_t         mode_current_uA[] = { 4000, 1500, 10, 10, 300, 300, 10000 };
+
+// Arduino core timekeeping (wiring.c), corrected after every sleep stopping Timer0
+extern volatile unsigned long timer0_millis;
+extern volatile unsigned long timer0_overflow_count;
+
+ // Microseconds counted by one Timer0 overflow of the Arduino core (prescaler 64)
+ #ifndef SLEEP_MICROS_PER_OVERFLOW
+  #define SLEEP_MICROS_PER_OVERFLOW (64UL * 256UL / (F_CPU / 1000000UL))
+ #endif
+
+// Sub-millisecond and sub-overflow remainders of the slept time already added to the core timekeeping
+static uint16_t slept_ms_remainder_us;
+static uint16_t slept_overflow_remainder_us;
+
+ // Number of SavePowerLog buffers drained before a sleep
+ #ifndef SAVEPOWER_LOG_BUFFERS
+  #define SAVEPOWER_LOG_BUFFERS 2
+ #endif
+
+// Log buffers registered by their constructor, the hook is only set by them so their code is not linked in sketches without any
+static SavePowerLog *log_buffers[SAVEPOWER_LOG_BUFFERS];
+static uint8_t      log_buffer_count;
+static void         (*log_sleep_hook)(uint32_t ms);
+
+ // Power trace : events kept in RAM (a power of two), and the EEPROM area holding the wear-levelled pages they are flushed to
+ #ifndef SAVEPOWER_TRACE_EVENTS
+  #define SAVEPOWER_TRACE_EVENTS 16
+ #endif
+
+ #ifndef SAVEPOWER_TRACE_EEPROM_START
+  #define SAVEPOWER_TRACE_EEPROM_START ((E2END + 1) / 2)
+ #endif
+
+ #ifndef SAVEPOWER_TRACE_PAGE_SIZE
+  #define SAVEPOWER_TRACE_PAGE_SIZE 64
+ #endif
+
+ #ifndef SAVEPOWER_TRACE_PAGES
+  #define SAVEPOWER_TRACE_PAGES ((E2END + 1 - SAVEPOWER_TRACE_EEPROM_START) / SAVEPOWER_TRACE_PAGE_SIZE)
+ #endif
+
+ // Trace page : sequence (2 bytes), event count, events lost before them, checksum, then 6 bytes per event
+ #ifndef TRACE_PAGE_HEADER
+  #define TRACE_PAGE_HEADER 5
+ #endif
+
+ #ifndef TRACE_EVENT_BYTES
+  #define TRACE_EVENT_BYTES 6
+ #endif
+
+ #ifndef TRACE_PAGE_EVENTS
+  #define TRACE_PAGE_EVENTS ((SAVEPOWER_TRACE_PAGE_SIZE - TRACE_PAGE_HEADER) / TRACE_EVENT_BYTES)
+ #endif
+
+ // Pseudo event type only recording the PRR and clock changes
+ #ifndef TRACE_REGISTERS
+  #define TRACE_REGISTERS 0xFE
+ #endif
+
+// Power trace state : ring buffer, last PRR and clock values recorded, wake up causes of the current sleep, and next EEPROM page. The 
+// hook is only set by StartTrace() so the recorder is not linked in sketches without a trace
+static SavePowerTraceEvent trace_events[SAVEPOWER_TRACE_EVENTS];
+static uint8_t  trace_head;
+static uint8_t  trace_count;
+static uint8_t  trace_lost;
+static uint8_t  trace_prr0;
+static uint8_t  trace_prr1;
+static uint8_t  trace_clock;
+static uint16_t trace_wake_cause;
+static uint8_t  trace_page;
+static uint16_t trace_sequence;
+static void     (*trace_hook)(uint8_t type, uint8_t value);
+
+ // Number of tasks of the cooperative scheduler
+ #ifndef SAVEPOWER_TASKS
+  #define SAVEPOWER_TASKS 8
+ #endif
+
+static_assert(SAVEPOWER_TASKS <= 16, "The scheduler handles up to 16 tasks");
+static_assert(SAVEPOWER_TRACE_PAGES >= 1 && SAVEPOWER_TRACE_PAGES <= 255, "The trace needs 1 to 255 EEPROM pages");
+static_assert(SAVEPOWER_TRACE_EEPROM_START + (uint32_t)SAVEPOWER_TRACE_PAGES * SAVEPOWER_TRACE_PAGE_SIZE <= E2END + 1UL, 
+              "The trace pages must fit in the EEPROM");
+static_assert(TRACE_PAGE_EVENTS >= 1 && TRACE_PAGE_EVENTS <= 255, "A trace page holds 1 to 255 events, its count is a byte");
+
+// Scheduler task : function, next deadline (a Now() value), period (0 for a task run once per ScheduleTask()), lateness allowed to 
+// share a wake up with another task, power domains used (1 << Power_Domain_Value) and sleep constraints (Sleep_Constraint_Value)
+struct Scheduler_Task
 {
-  if (Clock_Division_Factor == 1) { ClockSpeedDefaultState(); }
-  else if (Clock_Division_Factor == 2) { DivideClockSpeedByTwo(); }
-  else if (Clock_Division_Factor == 4) { DivideClockSpeedByFour(); }
-  else if (Clock_Division_Factor == 8) { DivideClockSpeedByEight(); }
-  else if (Clock_Division_Factor == 16) { DivideClockSpeedBySixteen(); }
-  else if (Clock_Division_Factor == 32) { DivideClockSpeedByThirtyTwo(); }
-  else if (Clock_Division_Factor == 64) { DivideClockSpeedBySixtyFour(); }
-  else if (Clock_Division_Factor == 128) { DivideClockSpeedByOneHundredTwentyEight(); }
-  else if (Clock_Division_Factor == 256) { DivideClockSpeedByTwoHundredFiftySix(); }
+  void     (*run)();
+  uint32_t due_ms;
+  uint32_t period_ms;
+  uint16_t slack_ms;
+  uint16_t domains;
+  uint8_t  constraints;
+  uint8_t  scheduled;
+};
+
+// Scheduler state : tasks, domains held for the sleep constraints of the tasks, and whether the scheduler manages the power domains
+static Scheduler_Task tasks[SAVEPOWER_TASKS];
+static uint16_t       task_held_domains;
+static uint8_t        task_managing;
+
+// Partial Watchdog period, when an interrupt wakes the MCU before the Watchdog does, and its slept part once measured at the period end
+static volatile uint8_t  partial_mode;
+static volatile uint8_t  partial_period;
+static volatile uint32_t partial_since_us;
+static volatile uint8_t  partial_measured;
+static volatile uint32_t partial_slept_us;
+
+// Clock prescaler timed sequence : CLKPCE alone, then the CLKPS bits within four cycles (ldi, sts, sts with bits already in a register)
+static inline void ClockPrescalerWrite(uint8_t bits)
+{
+  uint8_t sreg = SREG;
+  cli();
+  CLKPR = (1 << CLKPCE);
+  CLKPR = bits;
+  SREG = sreg;
 }
 
-// Entering MCU into Idle Sleep Mode
-void  SavePowerClass::IdleMode(Time_Out_Value time)
+// Frequency scaling state : division of F_CPU as a power of two (CLKPS bits, plus one on the RC oscillator of a 16MHz board), the division 
+// asked to ScaleClockSpeed(), and Timer0 slowdown (as a power of two) made up for in the core timekeeping
+static uint8_t  clock_division_bits;
+static uint8_t  clock_requested_bits;
+static uint8_t  clock_scale_shift;
+static uint32_t clock_scaled_since_ms;
+
+// Clock tree : system clock source, its division of F_CPU, PLL stopped around sleeps, and measured latencies
+static constexpr uint8_t clock_rc_shift = SavePowerClass::ClockDivisionBits(F_CPU / 8000000UL);
+static uint8_t  clock_source = CLOCK_EXTERNAL;
+static uint8_t  clock_source_shift;
+static uint8_t  pll_sleep_stop;
+static uint8_t  pll_stopped_for_sleep;
+static uint8_t  pll_stopped_for_rc;
+static SavePowerClockLatency clock_latency;
+
+// Timer0 prescaler (CS02:0) and slowdown for each CLKPS value, keeping Timer0 at F_CPU/64 whenever possible
+static constexpr uint8_t timer0_prescaler_bits[] = { 0x03, 0x03, 0x03, 0x02, 0x02, 0x02, 0x01, 0x01, 0x01 };
+static constexpr uint8_t timer0_slowdown_shift[] = { 0, 1, 2, 0, 1, 2, 0, 1, 2 };
+
+// PRR0/PRR1 bit of every Power_Domain_Value
+static constexpr uint8_t domain_prr0_bits[] = { (1 << PRSPI), (1 << PRTWI), (1 << PRADC), 0, 0, (1 << PRTIM0), (1 << PRTIM1), 0, 0 };
+static constexpr uint8_t domain_prr1_bits[] = { 0, 0, 0, (1 << PRUSART1), (1 << PRUSB), 0, 0, (1 << PRTIM3), (1 << PRTIM4) };
+
+// Power domains : users of each peripheral, peripherals ever acquired, and pending gated state per PRR register
+static uint8_t domain_users[POWER_DOMAINS];
+static uint8_t domain_managed0;
+static uint8_t domain_managed1;
+static uint8_t domain_gated0;
+static uint8_t domain_gated1;
+
+// Lazy re-initialisation : hook per domain (the domains stopped since their last initialisation are in savepower_core), and PRR 
+// values saved by DisableAllModules()
+static void     (*domain_reinit[POWER_DOMAINS])();
+static uint8_t  modules_saved;
+static uint8_t  modules_prr0;
+static uint8_t  modules_prr1;
+
+// Wake up sources : registered sources, callbacks, and causes of the current wake up filled in by the interrupts
+static void     (*wake_callbacks[WAKE_SOURCES])();
+static uint16_t wake_attached;
+static uint8_t  wake_int_mask;
+static uint8_t  wake_usb_suspended;
+static Stream   *wake_port;
+static int      wake_port_available;
+static volatile uint16_t wake_cause;
+static uint16_t last_wake_cause;
+
+// EIMSK bit and attachInterrupt() number (INT6 is number 4 on ATMega32u4) of WAKE_INT0 to WAKE_INT6
+static constexpr uint8_t wake_int_bits[] = { (1 << INT0), (1 << INT1), (1 << INT2), (1 << INT3), (1 << INT6) };
+
+// SleepMicros() compare match flag, and prescaler shift of the timer clock select values CS 1 to 5
+static volatile uint8_t micros_fired;
+static constexpr uint8_t micros_prescaler_shift[] = { 0, 0, 3, 6, 8, 10 };
+
+// Battery policy : table, cadence, last measurement and entry applied
+ #ifndef SAVEPOWER_BANDGAP_MV
+  #define SAVEPOWER_BANDGAP_MV 1100UL
+ #endif
+
+static const SavePowerVccPolicy *vcc_policy;
+static uint8_t  vcc_policy_count;
+static uint8_t  vcc_policy_index = 0xFF;
+static uint32_t vcc_cadence_ms;
+static uint32_t vcc_measured_ms;
+static uint16_t vcc_mv;
+static volatile uint8_t adc_single;
+
+// Pin sleep plan per port (PORTB to PORTF) : pins driven low, pulled up, and set as analog inputs, plus the DIDR bits to set
+static uint8_t pin_plan_low[5];
+static uint8_t pin_plan_pullup[5];
+static uint8_t pin_plan_analog[5];
+static uint8_t pin_plan_didr[3];
+static uint8_t pin_saved_ddr[5];
+static uint8_t pin_saved_port[5];
+static uint8_t pin_saved_didr[3];
+static uint8_t pin_plan_applied;
+
+// DDRx and PORTx of the ports B to F, and DIDR0 to DIDR2, by index
+typedef decltype(&DDRB) Pin_Register;
+static Pin_Register const pin_ddr[] = { &DDRB, &DDRC, &DDRD, &DDRE, &DDRF };
+static Pin_Register const pin_port[] = { &PORTB, &PORTC, &PORTD, &PORTE, &PORTF };
+static Pin_Register const pin_didr[] = { &DIDR0, &DIDR1, &DIDR2 };
+
+// ADC sampling engine : ring buffer filled by ADC_vect only (head) and emptied by the sketch only (tail)
+ #ifndef SAVEPOWER_ADC_BUFFER
+  #define SAVEPOWER_ADC_BUFFER 32
+ #endif
+
+ #ifndef SAVEPOWER_ADC_REFERENCE
+  #define SAVEPOWER_ADC_REFERENCE (1 << REFS0)
+ #endif
+
+static_assert(SAVEPOWER_ADC_BUFFER >= 2 && SAVEPOWER_ADC_BUFFER <= 256 && !(SAVEPOWER_ADC_BUFFER & (SAVEPOWER_ADC_BUFFER - 1)), 
+              "The ADC buffer is a power of two of 2 to 256 entries, indexed by a byte");
+
+static uint16_t adc_values[SAVEPOWER_ADC_BUFFER];
+static uint8_t  adc_value_channels[SAVEPOWER_ADC_BUFFER];
+static volatile uint8_t adc_head;
+static volatile uint8_t adc_tail;
+static const uint8_t *adc_channels;
+static uint8_t  adc_channel_count;
+static uint8_t  adc_oversampling;
+static volatile uint8_t  adc_channel_index;
+static volatile uint8_t  adc_taken;
+static volatile uint16_t adc_sum;
+static volatile uint8_t  adc_converted;
+static volatile uint16_t adc_stored;
+static void     (*adc_sample_hook)();
+
+// Start-up time of the oscillator selected by the CKSEL/SUT fuses, in clock cycles
+ #ifndef SAVEPOWER_OSC_STARTUP_CK
+  #define SAVEPOWER_OSC_STARTUP_CK 16384UL
+ #endif
+
+// Deepest first table of the SleepUntil() governor : mode, constraints it keeps and wake up latency
+struct Sleep_Mode_Profile
 {
-  if (time != SLEEP_FOREVER)
+  uint8_t  mode;
+  uint8_t  keeps;
+  uint16_t wake_latency_us;
+};
+
+static constexpr uint16_t CyclesToMicros(uint32_t cycles)
+{
+  return (uint16_t)((cycles * 1000UL + (F_CPU / 1000UL) - 1) / (F_CPU / 1000UL));
+}
+
+static constexpr Sleep_Mode_Profile sleep_profiles[] = 
+{
+  { MODE_POWER_DOWN,          NEED_TWI_ADDRESS,                                CyclesToMicros(SAVEPOWER_OSC_STARTUP_CK) },
+  { MODE_STANDBY,             NEED_TWI_ADDRESS | NEED_OSCILLATOR,              CyclesToMicros(6) },
+  { MODE_ADC_NOISE_REDUCTION, NEED_TWI_ADDRESS | NEED_OSCILLATOR | NEED_ADC,   CyclesToMicros(6) },
+  { MODE_IDLE,                0xFF,                                            CyclesToMicros(6) }
+};
+
+// Adding the time slept with Timer0 stopped to millis() and micros()
+static void AddSleptMicros(uint32_t us)
+{
+  uint32_t total;
+  uint8_t sreg = SREG;
+  cli();
+  total = us + slept_ms_remainder_us;
+  timer0_millis += total / 1000;
+  clock_scaled_since_ms += total / 1000;
+  slept_ms_remainder_us = total % 1000;
+  total = us + slept_overflow_remainder_us;
+  timer0_overflow_count += total / SLEEP_MICROS_PER_OVERFLOW;
+  slept_overflow_remainder_us = total % SLEEP_MICROS_PER_OVERFLOW;
+  SREG = sreg;
+}
+
+// Crediting the slept part of an interrupted Watchdog period
+static void PartialSleepResolve(uint32_t slept_us)
+{
+  savepower_core.partial_pending = 0;
+  partial_measured = 0;
+  power_stats.residency_ms[partial_mode] += slept_us / 1000;
+  active_since_ms += slept_us / 1000;
+  AddSleptMicros(slept_us);
+}
+
+// Ending an interrupted Watchdog period before its interrupt : half of what is left of it is credited (interrupts disabled)
+static void PartialSleepEstimate()
+{
+  uint32_t period_us = wdt_period_ms[partial_period] * 1000UL;
+  uint32_t awake_us = (micros() - partial_since_us) << clock_scale_shift;
+  PartialSleepResolve((period_us > awake_us) ? (period_us - awake_us) >> 1 : 0);
+}
+
+// Crediting the slept part measured at the end of an interrupted Watchdog period while the sketch was running
+static inline void PartialSleepCredit()
+{
+  uint8_t sreg = SREG;
+  cli();
+  if (partial_measured) PartialSleepResolve(partial_slept_us);
+  SREG = sreg;
+}
+
+// Re-arming the Watchdog from Sleep<>() ends an interrupted period as well
+void SavePowerPartialSleepEstimate()
+{
+  PartialSleepEstimate();
+}
+
+// Largest Watchdog period fitting in ms, rounding the last sub-period remainder to the nearest 16ms step 
+static uint8_t WatchdogPeriodFor(uint32_t ms)
+{
+  for (uint8_t period = WDTO_8S; period > WDTO_15MS; period--)
   {
-	wdt_enable(time);
-	WDTCSR |= (1 << WDIE);	
+    if (wdt_period_ms[period] <= ms) return period;	  
   }
-  EnterSleepMode(SLEEP_MODE_IDLE);
+  return (ms >= (uint32_t)(wdt_period_ms[WDTO_15MS] >> 1)) ? WDTO_15MS : WDT_NO_PERIOD;
 }
 
-// Entering MCU into ADC Noise Reduction Sleep Mode
-void  SavePowerClass::ADCNoiseReductionMode(Time_Out_Value time)
-{	
-  if (time != SLEEP_FOREVER)
+// Arm the Watchdog in interrupt mode only (WDE = 0), must be called with interrupts disabled for the timed sequence
+static inline void WatchdogArm(uint8_t period)
+{
+  uint8_t wdp = (period & 0x07) | ((period & 0x08) ? (1 << WDP3) : 0);
+  if (savepower_core.partial_pending) PartialSleepEstimate();
+  savepower_core.wdt_period_armed = period;
+  savepower_core.wdt_tick_armed = 0;
+  wdt_reset();
+  MCUSR &= ~(1 << WDRF);
+  WDTCSR = (1 << WDCE) | (1 << WDE);
+  WDTCSR = (1 << WDIE) | wdp;
+}
+
+// Stop the Watchdog, must be called with interrupts disabled for the timed sequence
+static inline void WatchdogDisarm()
+{
+  if (savepower_core.partial_pending) PartialSleepEstimate();
+  savepower_core.wdt_period_armed = WDT_NO_PERIOD;
+  savepower_core.wdt_tick_armed = 0;
+  wdt_reset();
+  MCUSR &= ~(1 << WDRF);
+  WDTCSR = (1 << WDCE) | (1 << WDE);
+  WDTCSR = 0x00;
+}
+
+// Take the next period of the SleepFor chain, or end the chain when the remaining time is consumed
+static inline void WatchdogChainNext()
+{
+  uint32_t remaining = sleep_remaining_ms;
+  uint8_t  period = WatchdogPeriodFor(remaining);
+  if (period == WDT_NO_PERIOD)
   {
-	wdt_enable(time);
-	WDTCSR |= (1 << WDIE);	
+    sleep_chaining = 0;
+    WatchdogDisarm();
+    return;
   }
-  EnterSleepMode(SLEEP_MODE_ADC);
+  sleep_remaining_ms = (remaining > wdt_period_ms[period]) ? remaining - wdt_period_ms[period] : 0;
+  WatchdogArm(period);
 }
 
-// Entering MCU into Power Down Sleep Mode
-void  SavePowerClass::PowerDownMode(Time_Out_Value time)
-{	
-  if (time != SLEEP_FOREVER)
+// Arm the Watchdog for the periodic tick, the hardware repeats the period until disarmed (interrupts disabled)
+static inline void WatchdogTickArm()
+{
+  WatchdogArm(wdt_tick_period);
+  savepower_core.wdt_tick_armed = 1;
+}
+
+// Give the Watchdog back to the periodic tick once a sleep or a calibration is done with it
+static inline void WatchdogTickResume()
+{
+  uint8_t sreg = SREG;
+  cli();
+  if (wdt_ticking && savepower_core.wdt_period_armed == WDT_NO_PERIOD) WatchdogTickArm();
+  SREG = sreg;
+}
+
+// Ending an interrupted Watchdog period before a sleep timed by other means, so that its interrupt does not add the same time again
+static void PartialSleepStop()
+{
+  uint8_t sreg = SREG;
+  PartialSleepCredit();
+  cli();
+  if (savepower_core.partial_pending)
   {
-	wdt_enable(time);
-	WDTCSR |= (1 << WDIE);	
+    if (savepower_core.wdt_tick_armed) WatchdogTickArm();
+    else WatchdogDisarm();
   }
-  EnterSleepMode(SLEEP_MODE_PWR_DOWN);
+  SREG = sreg;
+  WatchdogTickResume();
 }
 
-// Entering MCU into Power Save Sleep Mode
-void  SavePowerClass::PowerSaveMode(Time_Out_Value time)
-{	
-  if (time != SLEEP_FOREVER)
+// Adding to millis() the time Timer0 missed while running slower than F_CPU/64
+static void ClockScaleFixup()
+{
+  uint32_t counted;
+  uint8_t  sreg;
+  if (!clock_scale_shift) return;
+  sreg = SREG;
+  cli();
+  counted = timer0_millis - clock_scaled_since_ms;
+  timer0_millis += (counted << clock_scale_shift) - counted;
+  clock_scaled_since_ms = timer0_millis;
+  SREG = sreg;
+}
+
+// Waiting for the USART1 transmitter to be idle, bounded by one frame time in case nothing was ever sent
+static void USARTWaitIdle()
+{
+  uint32_t loops;
+  if (!(UCSR1B & (1 << TXEN1))) return;
+  while (!(UCSR1A & (1 << UDRE1))) {}
+  loops = ((uint32_t)UBRR1 + 1) * ((UCSR1A & (1 << U2X1)) ? 8 : 16) * 10 / 4;
+  while (!(UCSR1A & (1 << TXC1)) && loops--) {}
+}
+
+// Keeping the USART1 baud rate when the clock is divided by 2^from instead of 2^to
+static void USARTScaleBaudRate(uint8_t from, uint8_t to)
+{
+  uint32_t n8;
+  if (!(UCSR1B & ((1 << TXEN1) | (1 << RXEN1)))) return;
+  // Baud rate divider in units of 8 clock cycles (U2X1 on), rounded to the nearest one
+  n8 = ((uint32_t)UBRR1 + 1) * ((UCSR1A & (1 << U2X1)) ? 1 : 2);
+  n8 = ((n8 << from) + ((1UL << to) >> 1)) >> to;
+  if (n8 == 0) n8 = 1;
+  if (!(n8 & 1) && n8 <= 8192)
   {
-    wdt_enable(time);
-    WDTCSR |= (1 << WDIE);	
+    UCSR1A &= ~(1 << U2X1);
+    UBRR1 = (n8 >> 1) - 1;
+  }
+  else
+  {
+    UCSR1A |= (1 << U2X1);
+    UBRR1 = (n8 <= 4096) ? n8 - 1 : 4095;
   }
-  EnterSleepMode(SLEEP_MODE_PWR_SAVE);
 }
 
-// Entering MCU into Standby Sleep Mode
-void  SavePowerClass::StandbyMode(Time_Out_Value time)
+// Marking the domains whose clock is being stopped (given as PRR0/PRR1 bits going from 0 to 1) as needing a re-initialisation, for the 
+// methods of this file and the inline Disable methods
+void SavePowerDomainsStopped(uint8_t prr0_bits, uint8_t prr1_bits)
 {
-  if (time != SLEEP_FOREVER)
+  for (uint8_t domain = 0; domain < POWER_DOMAINS; domain++)
   {
-    wdt_enable(time);
-    WDTCSR |= (1 << WDIE);	
+    if ((domain_prr0_bits[domain] & prr0_bits) || (domain_prr1_bits[domain] & prr1_bits)) savepower_core.domain_stale |= (1 << domain);
   }
-  EnterSleepMode(SLEEP_MODE_STANDBY);
 }
 
-// Entering MCU into Extended Standby Sleep Mode
-void  SavePowerClass::ExtendedStandbyMode(Time_Out_Value time)
-{	
-  if (time != SLEEP_FOREVER)
+// Running the re-initialisation hooks of the domains powered up again (given as PRR0/PRR1 bits going from 1 to 0)
+static void DomainsStarted(uint8_t prr0_bits, uint8_t prr1_bits)
+{
+  for (uint8_t domain = 0; domain < POWER_DOMAINS; domain++)
   {
-    wdt_enable(time);
-	WDTCSR |= (1 << WDIE);	
+    if (!(savepower_core.domain_stale & (1 << domain))) continue;
+    if (!(domain_prr0_bits[domain] & prr0_bits) && !(domain_prr1_bits[domain] & prr1_bits)) continue;
+    savepower_core.domain_stale &= ~(1 << domain);
+    if (domain_reinit[domain]) domain_reinit[domain]();
   }
-  EnterSleepMode(SLEEP_MODE_EXT_STANDBY);
 }
 
-// Disable all microcontroller peripherals
-void SavePowerClass::DisableAllModules()
-{	
-  PRR0 = 0xAD;
-  PRR1 = 0x99;
+// A registered wake up source fired (from its interrupt)
+static inline void WakeSourceFired(uint8_t source)
+{
+  wake_cause |= (1 << source);
+  power_stats.wakes[source]++;
+  if (wake_callbacks[source]) wake_callbacks[source]();
 }
 
-// Disable Serial Peripheral Interface (SPI)
-void SavePowerClass::DisableSPI()
+static void WakeINT0() { EIMSK &= ~(1 << INT0); WakeSourceFired(WAKE_INT0); }
+static void WakeINT1() { EIMSK &= ~(1 << INT1); WakeSourceFired(WAKE_INT1); }
+static void WakeINT2() { EIMSK &= ~(1 << INT2); WakeSourceFired(WAKE_INT2); }
+static void WakeINT3() { EIMSK &= ~(1 << INT3); WakeSourceFired(WAKE_INT3); }
+static void WakeINT6() { EIMSK &= ~(1 << INT6); WakeSourceFired(WAKE_INT6); }
+
+static void (* const wake_int_handlers[])() = { WakeINT0, WakeINT1, WakeINT2, WakeINT3, WakeINT6 };
+
+// Arming all the registered wake up sources at once, called with interrupts disabled just before sleep_cpu()
+static inline void WakeSourcesArm()
 {
-  PRR0 |= (1 << PRSPI);   
+  wake_cause = 0;
+  if (wake_int_mask)
+  {
+    EIFR = wake_int_mask;
+    EIMSK |= wake_int_mask;
+  }
+  if (wake_attached & (1 << WAKE_PCINT))
+  {
+    PCIFR = (1 << PCIF0);
+    PCICR |= (1 << PCIE0);
+  }
+  wake_usb_suspended = UDIEN & (1 << WAKEUPE);
+  if (wake_port) wake_port_available = wake_port->available();
 }
 
-// Disable USB Interface 
-void SavePowerClass::DisableUSB()
+// Disarming all the registered wake up sources at once on wake up
+static inline void WakeSourcesDisarm()
 {
-  PRR1 |= (1 << PRUSB);    
+  if (wake_int_mask) EIMSK &= ~wake_int_mask;
+  if (wake_attached & (1 << WAKE_PCINT)) PCICR &= ~(1 << PCIE0);
 }
 
-// Disable Analog Digital Converter (ADC)
-void SavePowerClass::DisableADC()
+// Out of line part of the inline Enable methods : re-initialising the stale domains among the ones powered up
+void SavePowerReinitDomains(uint16_t domains)
 {
-  ADCSRA &= ~(1 << ADEN);
-  PRR0 |= (1 << PRADC);   
+  for (uint8_t domain = 0; domain < POWER_DOMAINS; domain++)
+  {
+    if (!(domains & savepower_core.domain_stale & (1 << domain))) continue;
+    savepower_core.domain_stale &= ~(1 << domain);
+    if (domain_reinit[domain]) domain_reinit[domain]();
+  }
 }
 
-// Disable Analog Comparator (AC) 
-void SavePowerClass::DisableAC()
+// Attributing a wake up no interrupt claimed, and calling the callbacks of the sources without their own interrupt
+static inline void WakeSourcesResolve()
 {
-  disable_ac();   
+  uint16_t cause = wake_cause;
+  uint8_t  source = WAKE_INTERRUPT;
+  if (!cause)
+  {
+    if ((wake_attached & (1 << WAKE_USB)) && wake_usb_suspended && (UDIEN & (1 << SUSPE))) source = WAKE_USB;
+    else if (wake_port && wake_port->available() != wake_port_available) source = WAKE_USART1;
+    cause = (1 << source);
+    power_stats.wakes[source]++;
+    if (source != WAKE_INTERRUPT && wake_callbacks[source]) wake_callbacks[source]();
+  }
+  last_wake_cause = cause;
 }
 
-// Disable Universal Synchronous and Asynchronous Receiver Transmitter (USART)
-void SavePowerClass::DisableUSART()
+// USB clocked and not frozen : the PLL and the crystal must keep running
+static inline bool UsbRunning()
 {
-  PRR1 |= (1 << PRUSART1);     
+  return !(PRR1 & (1 << PRUSB)) && (USBCON & (1 << USBE)) && !(USBCON & (1 << FRZCLK));
 }
 
-// Disable Two Wire Interface (TWI or I2C) 
-void SavePowerClass::DisableTWI()
+// Restarting the PLL and measuring the time it takes to lock
+static uint16_t PllStart()
 {
-  PRR0 |= (1 << PRTWI);   
+  uint32_t start = micros();
+  PLLCSR |= (1 << PLLE);
+  while (!(PLLCSR & (1 << PLOCK)));
+  clock_latency.pll_lock_us = (uint16_t)((micros() - start) << clock_scale_shift);
+  return clock_latency.pll_lock_us;
 }
 
-// Disable Timer0 
-void SavePowerClass::DisableTimer0()
+// Recording an event in the trace ring buffer, the oldest one is overwritten when it is full
+static void TraceStore(uint8_t type, uint8_t value)
 {
-  PRR0 |= (1 << PRTIM0);     
+  uint8_t index = (trace_head + trace_count) & (SAVEPOWER_TRACE_EVENTS - 1);
+  if (trace_count == SAVEPOWER_TRACE_EVENTS)
+  {
+    trace_head = (trace_head + 1) & (SAVEPOWER_TRACE_EVENTS - 1);
+    if (trace_lost < 0xFF) trace_lost++;
+  }
+  else trace_count++;
+  trace_events[index].time_ms = millis();
+  trace_events[index].type = type;
+  trace_events[index].value = value;
 }
 
-// Disable Timer1
-void SavePowerClass::DisableTimer1()
+// Trace hook : the PRR and clock changes since the last event first, then the event itself (one per cause for a wake up)
+static void TraceRecord(uint8_t type, uint8_t value)
 {
-  PRR0 |= (1 << PRTIM1);    
+  uint8_t prr0 = PRR0;
+  uint8_t prr1 = PRR1;
+  uint8_t clock = clock_division_bits | ((clock_source == CLOCK_RC) ? 0x80 : 0);
+  if (prr0 != trace_prr0) TraceStore(TRACE_PRR0, trace_prr0 = prr0);
+  if (prr1 != trace_prr1) TraceStore(TRACE_PRR1, trace_prr1 = prr1);
+  if (clock != trace_clock) TraceStore(TRACE_CLOCK, trace_clock = clock);
+  if (type == TRACE_REGISTERS) return;
+  if (type != TRACE_WAKE) 
+  {
+    TraceStore(type, value);
+    return;
+  }
+  if (!trace_wake_cause) TraceStore(TRACE_WAKE, TRACE_WAKE_TIMER);
+  for (uint8_t source = 0; source < WAKE_SOURCES; source++)
+  {
+    if (trace_wake_cause & (1 << source)) TraceStore(TRACE_WAKE, source);
+  }
 }
 
-// Disable Timer3
-void SavePowerClass::DisableTimer3()
+// Tracing an event when the trace runs
+static inline void Trace(uint8_t type, uint8_t value)
 {
-  PRR1 |= (1 << PRTIM3);     
+  if (trace_hook) trace_hook(type, value);
 }
 
-// Disable Timer4
-void SavePowerClass::DisableTimer4()
+// Closing the active period before entering a sleep mode
+static inline void AccountSleepEnter(Sleep_Mode_Value mode)
 {
-  PRR1 |= (1 << PRTIM4);    
+  uint32_t now;
+  PartialSleepCredit();
+  now = millis();
+  power_stats.residency_ms[MODE_ACTIVE] += now - active_since_ms;
+  active_since_ms = now;
+  trace_wake_cause = 0;
+  Trace(TRACE_SLEEP, mode);
+  savepower_core.sleep_mode_current = mode;
+  if (pll_sleep_stop && (PLLCSR & (1 << PLLE)) && !UsbRunning())
+  {
+    PLLCSR &= ~(1 << PLLE);
+    pll_stopped_for_sleep = 1;
+  }
 }
 
-// Enable all microcontroller peripherals
-void SavePowerClass::EnableAllModules()
+// Counting a wake up, Idle is measured with millis() as Timer0 keeps running in it
+static inline void AccountWake()
+{
+  uint32_t now;
+  WakeSourcesResolve();
+  trace_wake_cause |= last_wake_cause;
+  if (wdt_fired) 
+  {
+    wdt_fired = 0;
+    return;
+  }
+  if (savepower_core.sleep_mode_current == MODE_IDLE)
+  {
+    now = millis();
+    power_stats.residency_ms[MODE_IDLE] += now - active_since_ms;
+    active_since_ms = now;
+  }
+}
+
+// Back to active mode
+static inline void AccountSleepExit()
 {
-  PRR0 = 0x00;
-  PRR1 = 0x00; 
+  uint32_t now = millis();
+  if (savepower_core.sleep_mode_current == MODE_IDLE) power_stats.residency_ms[MODE_IDLE] += now - active_since_ms;
+  active_since_ms = now;
+  savepower_core.sleep_mode_current = MODE_ACTIVE;
+  if (pll_stopped_for_sleep)
+  {
+    pll_stopped_for_sleep = 0;
+    PllStart();
+  }
+  Trace(TRACE_WAKE, 0);
 }
 
-// Enable Serial Peripheral Interface (SPI)
-void SavePowerClass::EnableSPI()
+// Woken early with Timer0 stopped : the slept part is known when the Watchdog period ends, a period already interrupted keeps its start
+static inline void PartialSleepStart(Sleep_Mode_Value mode, uint8_t period)
 {
-  PRR0 &= ~(1 << PRSPI);     
+  cli();
+  if (!wdt_fired && !savepower_core.partial_pending)
+  {
+    partial_mode = mode;
+    partial_period = period;
+    partial_since_us = micros();
+    savepower_core.partial_pending = 1;
+  }
+  sei();
 }
 
-// Enable USB Interface 
-void SavePowerClass::EnableUSB()
+// Giving the log buffers a chance to drain before sleeping up to ms milliseconds
+static inline void LogsBeforeSleep(uint32_t ms)
 {
-  PRR1 &= ~(1 << PRUSB);    
+  if (log_sleep_hook) log_sleep_hook(ms);
 }
 
-// Enable Analog Digital Converter (ADC)
-void SavePowerClass::EnableADC()
+// Draining every registered log buffer whose data should not wait for the end of the sleep
+static void LogsFlushBeforeSleep(uint32_t ms)
 {
-  PRR0 &= ~(1 << PRADC);  
-  ADCSRA |= (1 << ADEN); 
+  for (uint8_t index = 0; index < log_buffer_count; index++) log_buffers[index]->FlushBeforeSleep(ms);
 }
 
-// Enable Analog Comparator (AC) 
-void SavePowerClass::EnableAC()
+// Single sleep shared by all the sleep mode methods, woken by the Watchdog or by any other interrupt
+static void SleepOnce(Sleep_Mode_Value mode, Time_Out_Value time)
 {
-  enable_ac();    
+  // Idle without time-out ends with the next Timer0 tick
+  LogsBeforeSleep((time != SLEEP_FOREVER) ? wdt_period_ms[time] : (mode == MODE_IDLE) ? 1 : 0xFFFFFFFF);
+  AccountSleepEnter(mode);
+  if (time != SLEEP_FOREVER)
+  {
+    cli();
+    WatchdogArm(time);
+    sei();
+  }
+  do
+  {
+    wdt_fired = 0;
+    EnterSleepMode(sleep_mode_bits[mode]);
+  } while (time == SLEEP_FOREVER && wake_cause == (1 << WAKE_WATCHDOG) && savepower_core.wdt_tick_armed);
+  if (mode != MODE_IDLE && savepower_core.wdt_period_armed != WDT_NO_PERIOD) PartialSleepStart(mode, savepower_core.wdt_period_armed);
+  AccountWake();
+  AccountSleepExit();
+  WatchdogTickResume();
 }
 
-// Enable Universal Synchronous and Asynchronous Receiver Transmitter (USART)
-void SavePowerClass::EnableUSART()
+// DIDR register (0 to 2) and bit of the digital input buffer of a port pin, 0xFF when it has none
+static uint8_t PinDIDR(uint8_t port, uint8_t bit, uint8_t &mask)
 {
-  PRR1 &= ~(1 << PRUSART1);    
+  // ADC0-7 are PF0-7 in DIDR0, ADC8-13 are PD4, PD6, PD7, PB4, PB5, PB6 in DIDR2, AIN0 is PE6 in DIDR1
+  static constexpr uint8_t adc8_port[] = { 2, 2, 2, 0, 0, 0 };
+  static constexpr uint8_t adc8_bit[] = { 4, 6, 7, 4, 5, 6 };
+  mask = 0;
+  if (port == 4)
+  {
+    mask = (1 << bit);
+    return 0;
+  }
+  if (port == 3 && bit == 6)
+  {
+    mask = (1 << AIN0D);
+    return 1;
+  }
+  for (uint8_t index = 0; index < sizeof(adc8_port); index++)
+  {
+    if (adc8_port[index] != port || adc8_bit[index] != bit) continue;
+    mask = (1 << index);
+    return 2;
+  }
+  return 0xFF;
 }
 
-// Enable Two Wire Interface (TWI or I2C)
-void SavePowerClass::EnableTWI()
+// Selecting the ADC channel given as MUX5:0, MUX5 is in ADCSRB
+static inline void ADCSelectChannel(uint8_t mux)
 {
-  PRR0 &= ~(1 << PRTWI);     
+  ADMUX = SAVEPOWER_ADC_REFERENCE | (mux & 0x1F);
+  ADCSRB = (ADCSRB & ~(1 << MUX5)) | ((mux & 0x20) ? (1 << MUX5) : 0);
 }
 
-// Enable Timer0
-void SavePowerClass::EnableTimer0()
+// Length of one conversion (13 ADC clocks) in microseconds, with the ADC and the system clock prescalers
+static inline uint32_t ADCConversionMicros()
 {
-  PRR0 &= ~(1 << PRTIM0);    
+  uint8_t adps = ADCSRA & 0x07;
+  return ((13UL << (adps ? adps : 1)) << clock_division_bits) / (F_CPU / 1000000UL);
 }
 
-// Enable Timer1
-void SavePowerClass::EnableTimer1()
+// One conversion in ADC Noise Reduction mode : entering the mode starts it, any other interrupt only sends the MCU back to sleep
+static inline void ADCSleepConversion()
 {
-  PRR0 &= ~(1 << PRTIM1);     
+  adc_converted = 0;
+  cli();
+  while (!adc_converted)
+  {
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    cli();
+  }
+  sei();
 }
 
-// Enable Timer3
-void SavePowerClass::EnableTimer3()
+// Adding the conversion time slept with Timer0 stopped to millis(), as ADC Noise Reduction residency
+static inline void ADCAccountSleep(uint32_t slept_us)
 {
-  PRR1 &= ~(1 << PRTIM3);     
+  AddSleptMicros(slept_us);
+  power_stats.residency_ms[MODE_ADC_NOISE_REDUCTION] += slept_us / 1000;
+  active_since_ms += slept_us / 1000;
 }
 
-// Enable Timer4
-void SavePowerClass::EnableTimer4()
+// Freezing the USB clock and stopping the PLL while the bus is suspended
+static inline void UsbFreeze()
 {
-  PRR1 &= ~(1 << PRTIM4);     
+  USBCON |= (1 << FRZCLK);
+  PLLCSR &= ~(1 << PLLE);
 }
 
-// Lowest Consumption Method
-void SavePowerClass::LowestConsumption(Time_Out_Value time)
-{ 
-  ACSR |= (1 <<ACD);     
-  ADCSRA &= ~(1 << ADEN);
-  PRR0 |= (1 << PRADC);  
-  if (time != SLEEP_FOREVER)
+// Restarting the PLL, waiting for its lock, then unfreezing the USB clock and clearing the wake up flag the core could not clear
+static inline void UsbThaw()
+{
+  PLLCSR |= (1 << PLLE);
+  while (!(PLLCSR & (1 << PLOCK)));
+  USBCON &= ~(1 << FRZCLK);
+  UDINT &= ~(1 << WAKEUPI);
+}
+
+// Dividing Clock Speed Method
+void SavePowerClass::DivideClockSpeed(int Clock_Division_Factor)
+{
+  if (Clock_Division_Factor < 1 || Clock_Division_Factor > 256 || (Clock_Division_Factor & (Clock_Division_Factor - 1))) return;
+  ClockPrescalerWrite(ClockDivisionBits(Clock_Division_Factor));
+  clock_division_bits = ClockDivisionBits(Clock_Division_Factor) + clock_source_shift;
+  Trace(TRACE_REGISTERS, 0);
+}
+
+// Switching to a division of F_CPU with Timer0 and USART1 following, called with interrupts disabled
+static void ClockScaleTo(uint8_t bits)
+{
+  ClockPrescalerWrite(bits - clock_source_shift);
+  TCCR0B = (TCCR0B & ~0x07) | timer0_prescaler_bits[bits];
+  USARTScaleBaudRate(clock_division_bits, bits);
+  clock_division_bits = bits;
+  clock_scale_shift = timer0_slowdown_shift[bits];
+  clock_scaled_since_ms = timer0_millis;
+  Trace(TRACE_REGISTERS, 0);
+}
+
+// Dividing Clock Speed while keeping timekeeping, delays and USART1 baud rate right
+void SavePowerClass::ScaleClockSpeed(int Clock_Division_Factor)
+{
+  uint8_t bits;
+  uint8_t sreg;
+  if (Clock_Division_Factor < 1 || Clock_Division_Factor > 256 || (Clock_Division_Factor & (Clock_Division_Factor - 1))) return;
+  bits = ClockDivisionBits(Clock_Division_Factor);
+  clock_requested_bits = bits;
+  if (bits < clock_source_shift) bits = clock_source_shift;
+  ClockScaleFixup();
+  USARTWaitIdle();
+  sreg = SREG;
+  cli();
+  ClockScaleTo(bits);
+  SREG = sreg;
+}
+
+// Switching the system clock between the crystal and the internal RC oscillator, keeping the timekeeping right
+bool SavePowerClass::SelectClockSource(Clock_Source_Value source)
+{
+  uint32_t start;
+  uint8_t  sreg;
+  if (source == clock_source) return true;
+  if (source == CLOCK_RC && UsbRunning()) return false;
+  ClockScaleFixup();
+  USARTWaitIdle();
+  if (source == CLOCK_RC)
   {
-	wdt_enable(time);
-	WDTCSR |= (1 << WDIE);	
+    // The PLL loses its input with the crystal, it is restarted when the crystal is selected again
+    if (!(PLLFRQ & (1 << PINMUX)) && (PLLCSR & (1 << PLLE)))
+    {
+      PLLCSR &= ~(1 << PLLE);
+      pll_stopped_for_rc = 1;
+    }
+    start = micros();
+    CLKSEL0 |= (1 << RCE);
+    while (!(CLKSTA & (1 << RCON)));
+    clock_latency.rc_startup_us = (uint16_t)((micros() - start) << clock_scale_shift);
+    sreg = SREG;
+    cli();
+    CLKSEL0 &= ~(1 << CLKS);
+    clock_source_shift = clock_rc_shift;
+    ClockScaleTo(clock_requested_bits < clock_rc_shift ? clock_rc_shift : clock_requested_bits);
+    CLKSEL0 &= ~(1 << EXTE);
   }
-  EnterSleepMode(SLEEP_MODE_PWR_DOWN);
-  PRR0 &= ~(1 << PRADC);
-  ADCSRA |= (1 << ADEN); 
-  ACSR &= ~(1 <<ACD);
+  else
+  {
+    start = micros();
+    CLKSEL0 |= (1 << EXTE);
+    while (!(CLKSTA & (1 << EXTON)));
+    clock_latency.crystal_startup_us = (uint16_t)((micros() - start) << clock_scale_shift);
+    sreg = SREG;
+    cli();
+    CLKSEL0 |= (1 << CLKS);
+    clock_source_shift = 0;
+    ClockScaleTo(clock_requested_bits);
+    CLKSEL0 &= ~(1 << RCE);
+  }
+  clock_source = source;
+  SREG = sreg;
+  Trace(TRACE_REGISTERS, 0);
+  if (source == CLOCK_EXTERNAL && pll_stopped_for_rc)
+  {
+    pll_stopped_for_rc = 0;
+    PllStart();
+  }
+  return true;
+}
+
+// Stopping the PLL, refused while USB runs from it
+bool SavePowerClass::StopPLL()
+{
+  if (UsbRunning()) return false;
+  PLLCSR &= ~(1 << PLLE);
+  pll_stopped_for_sleep = 0;
+  return true;
+}
+
+// Starting the PLL and waiting for its lock, returns the lock time in microseconds
+uint16_t SavePowerClass::StartPLL()
+{
+  return PllStart();
+}
+
+// Stopping the PLL before every sleep and restarting it on wake up, when USB does not run
+void SavePowerClass::SetPLLSleepStop(bool stop)
+{
+  pll_sleep_stop = stop;
 }
 
-ISR (WDT_vect) {}
+// Latencies of the clock tree measured so far
+SavePowerClockLatency SavePowerClass::GetClockLatency()
+{
+  return clock_latency;
+}
+
+// Waiting for real milliseconds whatever the clock division factor
+void SavePowerClass::Delay(uint32_t ms)
+{
+  delay(ms >> clock_scale_shift);
+  delayMicroseconds((uint16_t)((((ms & ((1 << clock_scale_shift) - 1)) * 1000UL) >> clock_division_bits)));
+}
+
+// Entering MCU into Idle Sleep Mode
+void  SavePowerClass::IdleMode(Time_Out_Value time)
+{
+  SleepOnce(MODE_IDLE, time);
+}
+
+// Entering MCU into ADC Noise Reduction Sleep Mode
+void  SavePowerClass::ADCNoiseReductionMode(Time_Out_Value time)
+{
+  SleepOnce(MODE_ADC_NOISE_REDUCTION, time);
+}
+
+// Entering MCU into Power Down Sleep Mode
+void  SavePowerClass::PowerDownMode(Time_Out_Value time)
+{
+  SleepOnce(MODE_POWER_DOWN, time);
+}
+
+// Entering MCU into Power Save Sleep Mode
+void  SavePowerClass::PowerSaveMode(Time_Out_Value time)
+{
+  SleepOnce(MODE_POWER_SAVE, time);
+}
+
+// Entering MCU into Standby Sleep Mode
+void  SavePowerClass::StandbyMode(Time_Out_Value time)
+{
+  SleepOnce(MODE_STANDBY, time);
+}
+
+// Entering MCU into Extended Standby Sleep Mode
+void  SavePowerClass::ExtendedStandbyMode(Time_Out_Value time)
+{
+  SleepOnce(MODE_EXTENDED_STANDBY, time);
+}
+
+// Disable all microcontroller peripherals
+void SavePowerClass::DisableAllModules()
+{	
+  modules_prr0 = PRR0;
+  modules_prr1 = PRR1;
+  modules_saved = 1;
+  SavePowerDomainsStopped(0xAD & ~modules_prr0, 0x99 & ~modules_prr1);
+  PRR0 = 0xAD;
+  PRR1 = 0x99;
+  Trace(TRACE_REGISTERS, 0);
+}
+
+// Enable all microcontroller peripherals
+void SavePowerClass::EnableAllModules()
+{
+  uint8_t prr0 = modules_saved ? modules_prr0 : 0x00;
+  uint8_t prr1 = modules_saved ? modules_prr1 : 0x00;
+  uint8_t stopped0 = PRR0;
+  uint8_t stopped1 = PRR1;
+  modules_saved = 0;
+  PRR0 = prr0;
+  PRR1 = prr1; 
+  DomainsStarted(stopped0 & ~prr0, stopped1 & ~prr1);
+  Trace(TRACE_REGISTERS, 0);
+}
+
+// Lowest Consumption Method
+void SavePowerClass::LowestConsumption(Time_Out_Value time)
+{ 
+  SavePowerSnapshot snapshot;
+  SaveState(snapshot);
+  ApplyPinSleepPlan();
+  ACSR |= (1 <<ACD);     
+  ADCSRA &= ~(1 << ADEN);
+  PRR0 |= (1 << PRADC);  
+  SleepOnce(MODE_POWER_DOWN, time);
+  RestorePinState();
+  RestoreState(snapshot);
+}
+
+// Measuring VCC in mV against the internal bandgap, with two conversions in ADC Noise Reduction mode
+uint16_t SavePowerClass::ReadVcc()
+{
+  SavePowerSnapshot snapshot;
+  uint32_t conversion_us;
+  uint16_t result;
+  PartialSleepStop();
+  SaveState(snapshot);
+  PRR0 &= ~(1 << PRADC);
+  ADCSRA = (snapshot.adcsra & 0x07) | (1 << ADEN) | (1 << ADIF) | (1 << ADIE);
+  ADMUX = (1 << REFS0) | 0x1E;
+  ADCSRB &= ~(1 << MUX5);
+  conversion_us = ADCConversionMicros();
+  adc_single = 1;
+  set_sleep_mode(SLEEP_MODE_ADC);
+  // The first conversion lets the bandgap settle, only the second one is kept
+  ADCSleepConversion();
+  ADCSleepConversion();
+  result = ADC;
+  adc_single = 0;
+  ADCSRA &= ~(1 << ADIE);
+  RestoreState(snapshot);
+  ADCAccountSleep(conversion_us << 1);
+  vcc_mv = result ? (uint16_t)(SAVEPOWER_BANDGAP_MV * 1024UL / result) : 0;
+  vcc_measured_ms = Now();
+  return vcc_mv;
+}
+
+// Setting the battery policy table (highest level first) and how often VCC is measured
+void SavePowerClass::SetVccPolicy(const SavePowerVccPolicy *table, uint8_t count, uint32_t cadence_ms)
+{
+  uint16_t optional = 0;
+  uint16_t dropped = (vcc_policy_index != 0xFF) ? vcc_policy[vcc_policy_index].dropped_domains : 0;
+  // The policy holds one reference on every optional peripheral it does not drop
+  for (uint8_t index = 0; index < vcc_policy_count; index++) optional |= vcc_policy[index].dropped_domains;
+  for (uint8_t domain = 0; domain < POWER_DOMAINS; domain++)
+  {
+    if ((optional & ~dropped) & (1 << domain)) ReleaseDomain((Power_Domain_Value)domain);
+  }
+  optional = 0;
+  for (uint8_t index = 0; index < count; index++) optional |= table[index].dropped_domains;
+  for (uint8_t domain = 0; domain < POWER_DOMAINS; domain++)
+  {
+    if (optional & (1 << domain)) AcquireDomain((Power_Domain_Value)domain);
+  }
+  CommitDomains();
+  vcc_policy = table;
+  vcc_policy_count = count;
+  vcc_policy_index = 0xFF;
+  vcc_cadence_ms = cadence_ms;
+}
+
+// Measuring VCC when the cadence elapsed, and applying the matching policy entry when it changes
+const SavePowerVccPolicy* SavePowerClass::UpdateVccPolicy()
+{
+  uint8_t  index;
+  uint16_t dropped;
+  uint16_t restored;
+  if (!vcc_policy_count) return 0;
+  if (vcc_policy_index != 0xFF && (uint32_t)(Now() - vcc_measured_ms) < vcc_cadence_ms) return &vcc_policy[vcc_policy_index];
+  ReadVcc();
+  for (index = 0; index < vcc_policy_count - 1 && vcc_mv < vcc_policy[index].min_mv; index++);
+  if (index == vcc_policy_index) return &vcc_policy[index];
+  dropped = vcc_policy[index].dropped_domains;
+  restored = (vcc_policy_index != 0xFF) ? vcc_policy[vcc_policy_index].dropped_domains & ~dropped : 0;
+  if (vcc_policy_index != 0xFF) dropped &= ~vcc_policy[vcc_policy_index].dropped_domains;
+  for (uint8_t domain = 0; domain < POWER_DOMAINS; domain++)
+  {
+    if (restored & (1 << domain)) AcquireDomain((Power_Domain_Value)domain);
+    if (dropped & (1 << domain)) ReleaseDomain((Power_Domain_Value)domain);
+  }
+  CommitDomains();
+  ScaleClockSpeed(vcc_policy[index].clock_division);
+  vcc_policy_index = index;
+  return &vcc_policy[index];
+}
+
+// Sleeping for ms times the sleep multiplier of the battery policy entry in use
+void SavePowerClass::AdaptiveSleepFor(uint32_t ms, Sleep_Mode_Value mode)
+{
+  const SavePowerVccPolicy *policy = UpdateVccPolicy();
+  SleepFor(policy ? ms * policy->sleep_multiplier : ms, mode);
+}
+
+// Declaring the state a pin (Arduino number) takes while the MCU sleeps, applied by ApplyPinSleepPlan()
+void SavePowerClass::SetPinSleepPolicy(uint8_t pin, Pin_Sleep_Value policy)
+{
+  uint8_t port = digitalPinToPort(pin);
+  uint8_t mask = digitalPinToBitMask(pin);
+  uint8_t didr_mask;
+  uint8_t didr;
+  uint8_t bit = 0;
+  if (port == NOT_A_PIN || port < PB || port > PF) return;
+  port -= PB;
+  while (!(mask & (1 << bit))) bit++;
+  didr = PinDIDR(port, bit, didr_mask);
+  pin_plan_low[port] &= ~mask;
+  pin_plan_pullup[port] &= ~mask;
+  pin_plan_analog[port] &= ~mask;
+  if (didr != 0xFF) pin_plan_didr[didr] &= ~didr_mask;
+  if (policy == PIN_OUTPUT_LOW) pin_plan_low[port] |= mask;
+  else if (policy == PIN_PULLUP) pin_plan_pullup[port] |= mask;
+  else if (policy == PIN_ANALOG)
+  {
+    pin_plan_analog[port] |= mask;
+    if (didr != 0xFF) pin_plan_didr[didr] |= didr_mask;
+  }
+}
+
+// Saving DDR, PORT and DIDR, then applying the pin sleep plan in one pass over the ports
+void SavePowerClass::ApplyPinSleepPlan()
+{
+  uint8_t sreg = SREG;
+  cli();
+  for (uint8_t port = 0; port < 5; port++)
+  {
+    uint8_t low = pin_plan_low[port];
+    uint8_t pullup = pin_plan_pullup[port];
+    uint8_t input = pullup | pin_plan_analog[port];
+    uint8_t ddr;
+    uint8_t out;
+    if (!(low | input)) continue;
+    ddr = *pin_ddr[port];
+    out = *pin_port[port];
+    pin_saved_ddr[port] = ddr;
+    pin_saved_port[port] = out;
+    // Outputs going low first, then the direction, then the pull-ups : no pin is ever driven high on the way
+    if (out & low) *pin_port[port] = out & ~low;
+    *pin_ddr[port] = (ddr & ~input) | low;
+    *pin_port[port] = (out & ~(low | input)) | pullup;
+  }
+  for (uint8_t didr = 0; didr < 3; didr++)
+  {
+    if (!pin_plan_didr[didr]) continue;
+    pin_saved_didr[didr] = *pin_didr[didr];
+    *pin_didr[didr] = pin_saved_didr[didr] | pin_plan_didr[didr];
+  }
+  pin_plan_applied = 1;
+  SREG = sreg;
+}
+
+// Restoring DDR, PORT and DIDR as saved by ApplyPinSleepPlan(), in one pass over the ports
+void SavePowerClass::RestorePinState()
+{
+  uint8_t sreg;
+  if (!pin_plan_applied) return;
+  sreg = SREG;
+  cli();
+  for (uint8_t port = 0; port < 5; port++)
+  {
+    uint8_t planned = pin_plan_low[port] | pin_plan_pullup[port] | pin_plan_analog[port];
+    uint8_t driven = pin_saved_ddr[port] & planned;
+    uint8_t out;
+    uint8_t level;
+    if (!planned) continue;
+    out = *pin_port[port];
+    // Outputs taking their saved level first, then the direction, then the rest of PORT : no pin is ever driven the wrong way
+    level = (out & ~driven) | (pin_saved_port[port] & driven);
+    if (level != out) *pin_port[port] = level;
+    *pin_ddr[port] = pin_saved_ddr[port];
+    *pin_port[port] = pin_saved_port[port];
+  }
+  for (uint8_t didr = 0; didr < 3; didr++)
+  {
+    if (pin_plan_didr[didr]) *pin_didr[didr] = pin_saved_didr[didr];
+  }
+  pin_plan_applied = 0;
+  SREG = sreg;
+}
+
+// Saving the peripheral power state before a deep sleep
+void SavePowerClass::SaveState(SavePowerSnapshot &snapshot)
+{
+  snapshot.prr0 = PRR0;
+  snapshot.prr1 = PRR1;
+  snapshot.adcsra = ADCSRA;
+  snapshot.adcsrb = ADCSRB;
+  snapshot.admux = ADMUX;
+  snapshot.acsr = ACSR;
+  snapshot.didr0 = DIDR0;
+  snapshot.didr1 = DIDR1;
+  snapshot.didr2 = DIDR2;
+}
+
+// Restoring exactly the saved peripheral power state, the ADC clock must run before its registers are written
+void SavePowerClass::RestoreState(const SavePowerSnapshot &snapshot)
+{
+  uint8_t stopped0 = PRR0;
+  uint8_t stopped1 = PRR1;
+  PRR0 = snapshot.prr0 & ~(1 << PRADC);
+  PRR1 = snapshot.prr1;
+  ADMUX = snapshot.admux;
+  ADCSRB = snapshot.adcsrb;
+  ADCSRA = snapshot.adcsra & ~((1 << ADSC) | (1 << ADIF));
+  if (snapshot.prr0 & (1 << PRADC)) PRR0 = snapshot.prr0;
+  ACSR = snapshot.acsr & ~(1 << ACI);
+  DIDR0 = snapshot.didr0;
+  DIDR1 = snapshot.didr1;
+  DIDR2 = snapshot.didr2;
+  DomainsStarted(stopped0 & ~snapshot.prr0, stopped1 & ~snapshot.prr1);
+}
+
+// Registering the function re-initialising a peripheral the first time it is powered up after the library stopped it
+void SavePowerClass::SetReinitHook(Power_Domain_Value domain, void (*hook)())
+{
+  domain_reinit[domain] = hook;
+}
+
+// Adding a user to a power domain, the clock is ungated by the next CommitDomains()
+void SavePowerClass::AcquireDomain(Power_Domain_Value domain)
+{
+  domain_managed0 |= domain_prr0_bits[domain];
+  domain_managed1 |= domain_prr1_bits[domain];
+  if (domain_users[domain]++ == 0)
+  {
+    domain_gated0 &= ~domain_prr0_bits[domain];
+    domain_gated1 &= ~domain_prr1_bits[domain];	
+  }
+}
+
+// Removing a user from a power domain, the clock is gated by the next CommitDomains() if it was the last one
+void SavePowerClass::ReleaseDomain(Power_Domain_Value domain)
+{
+  if (domain_users[domain] == 0) return;
+  if (--domain_users[domain] == 0)
+  {
+    domain_gated0 |= domain_prr0_bits[domain];
+    domain_gated1 |= domain_prr1_bits[domain];	
+  }
+}
+
+// Applying the pending power domain changes with one write per PRR register
+void SavePowerClass::CommitDomains()
+{
+  uint8_t sreg = SREG;
+  uint8_t prr0;
+  uint8_t prr1;
+  uint8_t next;
+  cli();
+  prr0 = PRR0;
+  prr1 = PRR1;
+  next = (prr0 & ~domain_managed0) | domain_gated0;
+  if (next != prr0)
+  {
+    if (next & ~prr0 & (1 << PRADC)) ADCSRA &= ~(1 << ADEN);
+    PRR0 = next;
+    if (prr0 & ~next & (1 << PRADC)) ADCSRA |= (1 << ADEN);
+  }
+  prr0 ^= next;
+  next = (prr1 & ~domain_managed1) | domain_gated1;
+  if (next != prr1) PRR1 = next;
+  prr1 ^= next;
+  SREG = sreg;
+  SavePowerDomainsStopped(prr0 & domain_gated0, prr1 & domain_gated1);
+  DomainsStarted(prr0 & ~domain_gated0, prr1 & ~domain_gated1);
+  Trace(TRACE_REGISTERS, 0);
+}
+
+// Sleeping for any duration by chaining Watchdog periods (the largest first)
+void SavePowerClass::SleepFor(uint32_t ms, Sleep_Mode_Value mode)
+{
+  LogsBeforeSleep(ms);
+  AccountSleepEnter(mode);
+  cli();
+  sleep_remaining_ms = ms;
+  sleep_chaining = 1;
+  WatchdogChainNext();
+  sei();
+  set_sleep_mode(sleep_mode_bits[mode]);
+  while (sleep_chaining)
+  {
+    cli();
+    if (!sleep_chaining) 
+    {
+      sei();
+      break;	
+    }
+    WakeSourcesArm();
+    wdt_fired = 0;
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    WakeSourcesDisarm();
+    sei();
+    if (wake_cause & wake_attached & ~(1 << WAKE_WATCHDOG))
+    {
+      // A registered wake up source ends the chain, the Watchdog stops at the end of its current period
+      sleep_chaining = 0;
+      if (mode != MODE_IDLE) PartialSleepStart(mode, savepower_core.wdt_period_armed);
+    }
+    AccountWake();
+  }
+  AccountSleepExit();
+  WatchdogTickResume();
+}
+
+// Sleeping in Idle mode for us microseconds, timed by the compare match B of Timer3 (or Timer1) with the other clocks gated but the ones 
+// of the power domains kept (a mask of 1 << Power_Domain_Value)
+void SavePowerClass::SleepMicros(uint32_t us, uint16_t domains)
+{
+  SavePowerSnapshot snapshot;
+  uint32_t rest_us = us;
+  uint32_t chunk_us;
+  uint32_t cycles = 0;
+  uint32_t ticks;
+  uint16_t tcnt;
+  uint16_t ocrb;
+  uint8_t  tccra;
+  uint8_t  tccrb;
+  uint8_t  timsk;
+  uint8_t  cs;
+  uint8_t  gated0 = MICROS_GATED_PRR0;
+  uint8_t  gated1 = MICROS_GATED_PRR1;
+  if (us < MICROS_CHUNK_US && ((us * (F_CPU / 1000000UL)) >> clock_division_bits) < (F_CPU / 1000000UL)) return;
+  LogsBeforeSleep(us / 1000);
+  PartialSleepStop();
+  AccountSleepEnter(MODE_IDLE);
+  SaveState(snapshot);
+  for (uint8_t domain = 0; domain < POWER_DOMAINS; domain++)
+  {
+    if (!(domains & (1 << domain))) continue;
+    gated0 &= ~domain_prr0_bits[domain];
+    gated1 &= ~domain_prr1_bits[domain];
+  }
+  if (gated0 & (1 << PRADC)) ADCSRA &= ~(1 << ADEN);
+  cli();
+  tccra = MICROS_TCCRA;
+  tccrb = MICROS_TCCRB;
+  tcnt = MICROS_TCNT;
+  ocrb = MICROS_OCRB;
+  timsk = MICROS_TIMSK;
+  PRR0 = (snapshot.prr0 | gated0) & ~MICROS_TIMER_PRR0;
+  PRR1 = (snapshot.prr1 | gated1) & ~MICROS_TIMER_PRR1;
+  MICROS_TCCRB = 0x00;
+  MICROS_TCCRA = 0x00;
+  MICROS_TIMSK = (1 << MICROS_OCIEB);
+  sei();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  while (rest_us || cycles >= (F_CPU / 1000000UL))
+  {
+    // The duration is turned into cycles one chunk at a time, a chunk fits the longest round so the count stays within 32 bits
+    chunk_us = (rest_us > MICROS_CHUNK_US) ? MICROS_CHUNK_US : rest_us;
+    rest_us -= chunk_us;
+    cycles += (chunk_us * (F_CPU / 1000000UL)) >> clock_division_bits;
+    if (cycles < (F_CPU / 1000000UL)) break;
+    // Smallest prescaler holding the rest of the duration, what it can not count is left for the next round
+    for (cs = 1; cs < 5 && (cycles >> micros_prescaler_shift[cs]) > 0xFFFF; cs++);
+    ticks = cycles >> micros_prescaler_shift[cs];
+    if (ticks > 0xFFFF) ticks = 0xFFFF;
+    cycles -= ticks << micros_prescaler_shift[cs];
+    cli();
+    micros_fired = 0;
+    MICROS_TCNT = 0;
+    // The compare match flag is set one tick after TCNT reached OCRB
+    MICROS_OCRB = (uint16_t)(ticks - 1);
+    MICROS_TIFR = (1 << MICROS_OCFB);
+    MICROS_TCCRB = cs;
+    while (!micros_fired)
+    {
+      sleep_enable();
+      sei();
+      sleep_cpu();
+      sleep_disable();
+      cli();
+    }
+    MICROS_TCCRB = 0x00;
+    sei();
+  }
+  cli();
+  MICROS_TIMSK = timsk;
+  MICROS_TIFR = (1 << MICROS_OCFB);
+  MICROS_TCNT = tcnt;
+  MICROS_OCRB = ocrb;
+  MICROS_TCCRA = tccra;
+  MICROS_TCCRB = tccrb;
+  sei();
+  RestoreState(snapshot);
+  // Only the time the timer counted is added, the cycles left over are under one microsecond of the undivided clock
+  AddSleptMicros(us - (((cycles << clock_division_bits) + (F_CPU / 1000000UL) - 1) / (F_CPU / 1000000UL)));
+  AccountSleepExit();
+}
+
+// USB bus suspended by the host : the core enables the WAKEUPE interrupt in place of SUSPE on suspend
+bool SavePowerClass::UsbSuspended()
+{
+  if (PRR1 & (1 << PRUSB)) return false;
+  return (USBCON & (1 << USBE)) && (UDIEN & (1 << WAKEUPE));
+}
+
+// Power Down mode with the USB clock frozen and the PLL stopped until the bus resumes, or a registered wake up source fires
+bool SavePowerClass::SleepWhileUsbSuspended()
+{
+  if (!UsbSuspended()) return false;
+  UsbFreeze();
+  while (UsbSuspended())
+  {
+    // The Watchdog tick wakes the MCU by itself, otherwise the longest period bounds each sleep
+    if (wdt_ticking) SleepOnce(MODE_POWER_DOWN, SLEEP_FOREVER);
+    else SleepOnce(MODE_POWER_DOWN, WDTO_8S);
+    if (last_wake_cause & wake_attached & ~((1 << WAKE_WATCHDOG) | (1 << WAKE_USB))) break;
+  }
+  UsbThaw();
+  return true;
+}
+
+// Measuring the real period of the Watchdog oscillator against the system clock 
+uint16_t SavePowerClass::CalibrateWatchdog()
+{
+  uint32_t start;
+  uint32_t elapsed;
+  PartialSleepCredit();
+  cli();
+  wdt_fired = 0;
+  WatchdogArm(WDTO_120MS);
+  start = micros();
+  sei();
+  do
+  {
+    elapsed = (micros() - start) << clock_scale_shift;
+  } while (!wdt_fired);
+  cli();
+  WatchdogDisarm();
+  sei();
+  WatchdogTickResume();
+  // 128ms nominal period, 1024 == nominal : factor = elapsed * 1024 / 128000
+  SetWatchdogCalibration((uint16_t)((elapsed * 16 + 1000) / 2000));
+  return wdt_calibration;
+}
+
+// Applying a Watchdog calibration factor (1024 means the nominal 128kHz)
+void SavePowerClass::SetWatchdogCalibration(uint16_t factor)
+{
+  wdt_calibration = factor;
+  for (uint8_t period = WDTO_15MS; period <= WDTO_8S; period++)
+  {
+    wdt_period_ms[period] = (uint16_t)(((uint32_t)(16UL << period) * factor + 512) >> 10);
+  }
+}
+
+// Milliseconds since power up, including the time slept with Timer0 stopped
+uint32_t SavePowerClass::Now()
+{
+  ClockScaleFixup();
+  return millis();
+}
+
+// Power domains kept clocked for a set of sleep constraints
+static uint16_t ConstraintDomains(uint8_t constraints)
+{
+  uint16_t domains = 0;
+  if (constraints & NEED_USART1) domains |= (1 << DOMAIN_USART1);
+  if (constraints & NEED_TIMERS) domains |= (1 << DOMAIN_TIMER1) | (1 << DOMAIN_TIMER3) | (1 << DOMAIN_TIMER4);
+  if (constraints & NEED_SPI) domains |= (1 << DOMAIN_SPI);
+  if (constraints & NEED_USB) domains |= (1 << DOMAIN_USB);
+  if (constraints & NEED_ADC) domains |= (1 << DOMAIN_ADC);
+  if (constraints & NEED_TWI_ADDRESS) domains |= (1 << DOMAIN_TWI);
+  return domains;
+}
+
+// Sleeping until a deadline in the deepest mode compatible with the constraints and the wake up latency, the scheduler also stops when 
+// a registered wake up source ends the deep sleep
+static Sleep_Mode_Value SleepUntilDeadline(uint32_t deadline, uint8_t constraints, bool stop_on_source)
+{
+  int32_t  slack_ms = (int32_t)(deadline - SavePower.Now());
+  uint32_t sleep_ms;
+  uint8_t  index;
+  Sleep_Mode_Value mode = MODE_IDLE;
+  // Only a wake up of this sleep may end it, not the one of an earlier sleep
+  last_wake_cause = 0;
+  if (slack_ms <= 0) return MODE_ACTIVE;
+  for (index = 0; index < sizeof(sleep_profiles) / sizeof(sleep_profiles[0]); index++)
+  {
+    const Sleep_Mode_Profile& profile = sleep_profiles[index];
+    uint32_t latency_ms = (profile.wake_latency_us + 999) / 1000;
+    if ((profile.keeps & constraints) != constraints || (uint32_t)slack_ms <= latency_ms) continue;
+    // The last Watchdog period is rounded to the nearest 16ms step, keep half a step to never overshoot the deadline
+    sleep_ms = slack_ms - latency_ms;
+    if (sleep_ms < wdt_period_ms[WDTO_15MS] + (wdt_period_ms[WDTO_15MS] >> 1)) continue;
+    mode = (Sleep_Mode_Value)profile.mode;
+    if (mode == MODE_IDLE) break;
+    SavePower.SleepFor(sleep_ms - (wdt_period_ms[WDTO_15MS] >> 1), mode);
+    if (stop_on_source && (last_wake_cause & wake_attached & ~(1 << WAKE_WATCHDOG))) return mode;
+    break;
+  }
+  // Idle until the deadline, timed by SleepMicros() instead of being woken by every Timer0 tick (the wake up sources are not armed)
+  while ((slack_ms = (int32_t)(deadline - SavePower.Now())) > 0)
+  {
+    // The timers the caller keeps must go on counting : SleepMicros() would stop Timer3 and gate Timer0
+    if (constraints & NEED_TIMERS)
+    {
+      SleepOnce(MODE_IDLE, SLEEP_FOREVER);
+      continue;
+    }
+    if (slack_ms > SLEEP_UNTIL_MICROS_MAX_MS) slack_ms = SLEEP_UNTIL_MICROS_MAX_MS;
+    SavePower.SleepMicros((uint32_t)slack_ms * 1000UL, ConstraintDomains(constraints));
+  }
+  return mode;
+}
+
+// Sleeping until a deadline in the deepest mode compatible with the constraints and the wake up latency
+Sleep_Mode_Value SavePowerClass::SleepUntil(uint32_t deadline, uint8_t constraints)
+{
+  return SleepUntilDeadline(deadline, constraints, false);
+}
+
+// Acquiring (acquire true) or releasing every power domain of a mask, without committing them
+static void DomainsAcquire(uint16_t domains, bool acquire)
+{
+  for (uint8_t domain = 0; domain < POWER_DOMAINS; domain++)
+  {
+    if (!(domains & (1 << domain))) continue;
+    if (acquire) SavePower.AcquireDomain((Power_Domain_Value)domain);
+    else SavePower.ReleaseDomain((Power_Domain_Value)domain);
+  }
+}
+
+// Handing every peripheral but Timer0 (millis()) and a running USB to the power domains, so the ones no task uses are gated
+static void TasksManageDomains()
+{
+  uint16_t domains = ((1 << POWER_DOMAINS) - 1) & ~(1 << DOMAIN_TIMER0);
+  if (UsbRunning()) domains &= ~(1 << DOMAIN_USB);
+  for (uint8_t domain = 0; domain < POWER_DOMAINS; domain++)
+  {
+    if (!(domains & (1 << domain))) continue;
+    domain_managed0 |= domain_prr0_bits[domain];
+    domain_managed1 |= domain_prr1_bits[domain];
+    if (domain_users[domain]) continue;
+    domain_gated0 |= domain_prr0_bits[domain];
+    domain_gated1 |= domain_prr1_bits[domain];
+  }
+  task_managing = 1;
+}
+
+// Registering a task run every period_ms from the next RunTasks() (period 0 : run once per ScheduleTask()), it may run up to slack_ms 
+// late to share a wake up with another task. Returns the task number, or 0xFF when all the SAVEPOWER_TASKS slots are used
+uint8_t SavePowerClass::AddTask(void (*task)(), uint32_t period_ms, uint16_t slack_ms, uint16_t domains, uint8_t constraints)
+{
+  uint8_t sreg;
+  for (uint8_t index = 0; index < SAVEPOWER_TASKS; index++)
+  {
+    if (tasks[index].run) continue;
+    sreg = SREG;
+    cli();
+    tasks[index].due_ms = Now();
+    tasks[index].period_ms = period_ms;
+    tasks[index].slack_ms = slack_ms;
+    tasks[index].domains = domains;
+    tasks[index].constraints = constraints;
+    tasks[index].scheduled = (period_ms != 0);
+    tasks[index].run = task;
+    SREG = sreg;
+    return index;
+  }
+  return 0xFF;
+}
+
+// Scheduling the next run of a task at a deadline (a Now() value), can be called from an interrupt
+void SavePowerClass::ScheduleTask(uint8_t task, uint32_t deadline)
+{
+  uint8_t sreg;
+  if (task >= SAVEPOWER_TASKS || !tasks[task].run) return;
+  sreg = SREG;
+  cli();
+  tasks[task].due_ms = deadline;
+  tasks[task].scheduled = 1;
+  SREG = sreg;
+}
+
+// Unregistering a task
+void SavePowerClass::RemoveTask(uint8_t task)
+{
+  uint8_t sreg;
+  if (task >= SAVEPOWER_TASKS) return;
+  sreg = SREG;
+  cli();
+  tasks[task].run = 0;
+  tasks[task].scheduled = 0;
+  SREG = sreg;
+}
+
+// One round of the scheduler : running the tasks due with their power domains up, then sleeping until the next wake up
+Sleep_Mode_Value SavePowerClass::RunTasks()
+{
+  uint32_t now;
+  uint32_t wake_ms = 0;
+  uint16_t run_domains = 0;
+  uint16_t held_domains = 0;
+  uint8_t  constraints = 0;
+  uint16_t due = 0;
+  uint8_t  waiting = 0;
+  uint8_t  sreg;
+  uint8_t  index;
+  if (!task_managing) TasksManageDomains();
+  // The tasks due share a single power up of the domains they use
+  now = Now();
+  sreg = SREG;
+  cli();
+  for (index = 0; index < SAVEPOWER_TASKS; index++)
+  {
+    if (!tasks[index].run || !tasks[index].scheduled || (int32_t)(tasks[index].due_ms - now) > 0) continue;
+    due |= (1 << index);
+    run_domains |= tasks[index].domains;
+  }
+  SREG = sreg;
+  if (due)
+  {
+    DomainsAcquire(run_domains, true);
+    CommitDomains();
+    for (index = 0; index < SAVEPOWER_TASKS; index++)
+    {
+      if (!(due & (1 << index)) || !tasks[index].run) continue;
+      sreg = SREG;
+      cli();
+      // Periodic tasks keep their cadence, unless they are more than a period late
+      if (!tasks[index].period_ms) tasks[index].scheduled = 0;
+      else if ((int32_t)(now - tasks[index].due_ms) >= (int32_t)tasks[index].period_ms) tasks[index].due_ms = now + tasks[index].period_ms;
+      else tasks[index].due_ms += tasks[index].period_ms;
+      SREG = sreg;
+      tasks[index].run();
+    }
+    DomainsAcquire(run_domains, false);
+  }
+  // Next wake up : the earliest deadline plus slack, so that the tasks due meanwhile run together
+  sreg = SREG;
+  cli();
+  for (index = 0; index < SAVEPOWER_TASKS; index++)
+  {
+    if (!tasks[index].run) continue;
+    constraints |= tasks[index].constraints;
+    if (!tasks[index].scheduled) continue;
+    if (!waiting || (int32_t)(tasks[index].due_ms + tasks[index].slack_ms - wake_ms) < 0) wake_ms = tasks[index].due_ms + tasks[index].slack_ms;
+    waiting = 1;
+  }
+  SREG = sreg;
+  // The peripherals the sleep must keep stay held, all the others are gated
+  held_domains = ConstraintDomains(constraints);
+  DomainsAcquire(held_domains & ~task_held_domains, true);
+  DomainsAcquire(task_held_domains & ~held_domains, false);
+  task_held_domains = held_domains;
+  CommitDomains();
+  if (waiting) return SleepUntilDeadline(wake_ms, constraints, true);
+  // Nothing scheduled : the deepest mode the constraints allow, until a registered wake up source fires
+  for (index = 0; index < sizeof(sleep_profiles) / sizeof(sleep_profiles[0]); index++)
+  {
+    if ((sleep_profiles[index].keeps & constraints) != constraints) continue;
+    SleepOnce((Sleep_Mode_Value)sleep_profiles[index].mode, SLEEP_FOREVER);
+    return (Sleep_Mode_Value)sleep_profiles[index].mode;
+  }
+  return MODE_ACTIVE;
+}
+
+// Snapshot of the energy accounting, with the charge estimated from the per mode current table
+SavePowerStats SavePowerClass::GetPowerStats()
+{
+  SavePowerStats stats;
+  uint8_t sreg = SREG;
+  cli();
+  stats = power_stats;
+  SREG = sreg;
+  stats.residency_ms[MODE_ACTIVE] += millis() - active_since_ms;
+  stats.charge_uAh = 0;
+  for (uint8_t mode = MODE_IDLE; mode <= MODE_ACTIVE; mode++)
+  {
+    stats.charge_uAh += (float)stats.residency_ms[mode] * mode_current_uA[mode] / 3600000.0;
+  }
+  return stats;
+}
+
+// Clearing the energy accounting counters
+void SavePowerClass::ResetPowerStats()
+{
+  uint8_t sreg = SREG;
+  cli();
+  power_stats = SavePowerStats();
+  active_since_ms = millis();
+  SREG = sreg;
+}
+
+// Setting the current drawn in a mode (MODE_ACTIVE for the active mode), used by the charge estimate
+void SavePowerClass::SetModeCurrent(Sleep_Mode_Value mode, uint16_t current_uA)
+{
+  mode_current_uA[mode] = current_uA;
+}
+
+// Registering a wake up source, armed before every sleep from now on
+void SavePowerClass::AttachWakeSource(Wake_Source_Value source, void (*callback)(), uint8_t mode)
+{
+  uint8_t sreg;
+  if (source == WAKE_USART1) return;
+  sreg = SREG;
+  cli();
+  wake_callbacks[source] = callback;
+  wake_attached |= (1 << source);
+  if (source >= WAKE_INT0 && source <= WAKE_INT6)
+  {
+    attachInterrupt(source - WAKE_INT0, wake_int_handlers[source - WAKE_INT0], mode);
+    EIMSK &= ~wake_int_bits[source - WAKE_INT0];
+    wake_int_mask |= wake_int_bits[source - WAKE_INT0];
+  }
+  else if (source == WAKE_PCINT)
+  {
+    PCMSK0 = mode;
+  }
+  SREG = sreg;
+}
+
+// Registering the reception of a serial port (Serial1) as the WAKE_USART1 source, recognized from the bytes it received
+void SavePowerClass::AttachWakeSource(Stream &port, void (*callback)())
+{
+  uint8_t sreg = SREG;
+  cli();
+  wake_callbacks[WAKE_USART1] = callback;
+  wake_attached |= (1 << WAKE_USART1);
+  wake_port = &port;
+  SREG = sreg;
+}
+
+// Unregistering a wake up source
+void SavePowerClass::DetachWakeSource(Wake_Source_Value source)
+{
+  uint8_t sreg = SREG;
+  cli();
+  wake_callbacks[source] = 0;
+  wake_attached &= ~(1 << source);
+  if (source == WAKE_USART1) wake_port = 0;
+  if (source >= WAKE_INT0 && source <= WAKE_INT6)
+  {
+    detachInterrupt(source - WAKE_INT0);
+    wake_int_mask &= ~wake_int_bits[source - WAKE_INT0];
+  }
+  else if (source == WAKE_PCINT)
+  {
+    PCMSK0 = 0x00;
+  }
+  SREG = sreg;
+}
+
+// Bitmask (1 << Wake_Source_Value) of the sources which woke the MCU up last time
+uint16_t SavePowerClass::LastWakeCause()
+{
+  return last_wake_cause;
+}
+
+// Running the periodic Watchdog tick, the callback is called every ticks periods from the Watchdog interrupt
+void SavePowerClass::StartWatchdogTick(Time_Out_Value period, uint16_t ticks, void (*callback)())
+{
+  uint8_t sreg = SREG;
+  if (period == SLEEP_FOREVER) return;
+  cli();
+  wdt_tick_callback = callback;
+  wdt_tick_every = ticks ? ticks : 1;
+  wdt_tick_count = 0;
+  wdt_tick_period = period;
+  wdt_ticking = 1;
+  if (savepower_core.wdt_period_armed == WDT_NO_PERIOD || savepower_core.wdt_tick_armed) WatchdogTickArm();
+  SREG = sreg;
+}
+
+// Stopping the periodic Watchdog tick, a period still measuring an early wake up ends normally
+void SavePowerClass::StopWatchdogTick()
+{
+  uint8_t sreg = SREG;
+  cli();
+  wdt_ticking = 0;
+  if (savepower_core.wdt_tick_armed)
+  {
+    savepower_core.wdt_tick_armed = 0;
+    if (!savepower_core.partial_pending) WatchdogDisarm();
+  }
+  SREG = sreg;
+}
+
+// Conversion of a burst : accumulating the oversampled conversions, storing the decimated result and selecting the next channel
+static void ADCSampleStore()
+{
+  uint8_t head;
+  uint8_t next;
+  adc_sum += ADC;
+  if (++adc_taken < (1 << (adc_oversampling << 1))) return;
+  head = adc_head;
+  next = (head + 1) & (SAVEPOWER_ADC_BUFFER - 1);
+  if (next != adc_tail)
+  {
+    adc_values[head] = adc_sum >> adc_oversampling;
+    adc_value_channels[head] = adc_channels[adc_channel_index];
+    adc_head = next;
+    adc_stored++;
+  }
+  adc_taken = 0;
+  adc_sum = 0;
+  if (++adc_channel_index >= adc_channel_count) adc_channel_index = 0;
+  ADCSelectChannel(adc_channels[adc_channel_index]);
+}
+
+// Setting the channels (MUX5:0 values) sampled in turn by SampleBurst(), each result being 4^oversampling_bits conversions
+void SavePowerClass::SetSamplingChannels(const uint8_t *channels, uint8_t count, uint8_t oversampling_bits)
+{
+  adc_sample_hook = ADCSampleStore;
+  adc_channels = channels;
+  adc_channel_count = count;
+  adc_oversampling = (oversampling_bits > 3) ? 3 : oversampling_bits;
+  adc_channel_index = 0;
+}
+
+// Taking results in ADC Noise Reduction mode, one sleep per conversion, returns the number of results stored in the ring buffer
+uint16_t SavePowerClass::SampleBurst(uint16_t results)
+{
+  SavePowerSnapshot snapshot;
+  uint32_t conversion_us;
+  uint32_t slept_us = 0;
+  uint32_t conversions;
+  if (!adc_channel_count || !results) return 0;
+  PartialSleepStop();
+  SaveState(snapshot);
+  PRR0 &= ~(1 << PRADC);
+  ADCSRA = (snapshot.adcsra & 0x07) | (1 << ADEN) | (1 << ADIF) | (1 << ADIE);
+  for (uint8_t index = 0; index < adc_channel_count; index++)
+  {
+    uint8_t mux = adc_channels[index];
+    if (mux < 0x08) DIDR0 |= (1 << mux);
+    else if (mux >= 0x20 && mux < 0x26) DIDR2 |= (1 << (mux - 0x20));
+  }
+  conversion_us = ADCConversionMicros();
+  conversions = (uint32_t)results << (adc_oversampling << 1);
+  adc_taken = 0;
+  adc_sum = 0;
+  adc_stored = 0;
+  ADCSelectChannel(adc_channels[adc_channel_index]);
+  set_sleep_mode(SLEEP_MODE_ADC);
+  while (conversions--)
+  {
+    ADCSleepConversion();
+    slept_us += conversion_us;
+  }
+  ADCSRA &= ~(1 << ADIE);
+  RestoreState(snapshot);
+  ADCAccountSleep(slept_us);
+  return adc_stored;
+}
+
+// Number of results waiting in the ring buffer
+uint8_t SavePowerClass::SamplesAvailable()
+{
+  return (uint8_t)(adc_head - adc_tail) & (SAVEPOWER_ADC_BUFFER - 1);
+}
+
+// Taking the oldest result and the channel (MUX5:0) it was sampled on, false when the ring buffer is empty
+bool SavePowerClass::ReadSample(uint16_t &value, uint8_t &channel)
+{
+  uint8_t tail = adc_tail;
+  if (tail == adc_head) return false;
+  value = adc_values[tail];
+  channel = adc_value_channels[tail];
+  adc_tail = (tail + 1) & (SAVEPOWER_ADC_BUFFER - 1);
+  return true;
+}
+
+// Checksum of a trace page, over its header (checksum byte excluded) and its events
+static uint8_t TracePageChecksum(const uint8_t *page, uint8_t count)
+{
+  uint8_t  checksum = 0x5A;
+  uint16_t size = TRACE_PAGE_HEADER + count * TRACE_EVENT_BYTES;
+  for (uint16_t index = 0; index < size; index++)
+  {
+    if (index == TRACE_PAGE_HEADER - 1) continue;
+    checksum = ((checksum << 1) | (checksum >> 7)) ^ page[index];
+  }
+  return checksum;
+}
+
+// Reading a trace page from EEPROM, returning its event count or -1 when it does not hold a valid page
+static int8_t TracePageRead(uint8_t index, uint8_t *page)
+{
+  const uint8_t *address = (const uint8_t *)(uintptr_t)(SAVEPOWER_TRACE_EEPROM_START + index * SAVEPOWER_TRACE_PAGE_SIZE);
+  eeprom_read_block(page, address, TRACE_PAGE_HEADER);
+  if (page[2] == 0 || page[2] > TRACE_PAGE_EVENTS) return -1;
+  eeprom_read_block(page + TRACE_PAGE_HEADER, address + TRACE_PAGE_HEADER, page[2] * TRACE_EVENT_BYTES);
+  if (TracePageChecksum(page, page[2]) != page[TRACE_PAGE_HEADER - 1]) return -1;
+  return page[2];
+}
+
+// Starting the power trace : the next EEPROM page follows the one with the latest sequence number, and the first events record the 
+// reset flags and the current PRR and clock values
+void SavePowerClass::StartTrace()
+{
+  uint8_t  page[SAVEPOWER_TRACE_PAGE_SIZE];
+  uint16_t sequence;
+  bool     found = false;
+  trace_page = 0;
+  trace_sequence = 0;
+  for (uint8_t index = 0; index < SAVEPOWER_TRACE_PAGES; index++)
+  {
+    if (TracePageRead(index, page) < 0) continue;
+    sequence = page[0] | (page[1] << 8);
+    if (found && (int16_t)(sequence - trace_sequence) <= 0) continue;
+    found = true;
+    trace_sequence = sequence;
+    trace_page = index;
+  }
+  if (found)
+  {
+    trace_sequence++;
+    trace_page = (trace_page + 1) % SAVEPOWER_TRACE_PAGES;
+  }
+  trace_prr0 = ~PRR0;
+  trace_prr1 = ~PRR1;
+  trace_clock = 0xFF;
+  trace_hook = TraceRecord;
+  TraceStore(TRACE_START, MCUSR);
+  Trace(TRACE_REGISTERS, 0);
+}
+
+// Stopping the power trace, the events not flushed yet stay in RAM
+void SavePowerClass::StopTrace()
+{
+  trace_hook = 0;
+}
+
+// Writing the events kept in RAM to the next EEPROM pages, the header last so that an interrupted write leaves an invalid page
+uint8_t SavePowerClass::FlushTrace()
+{
+  uint8_t page[SAVEPOWER_TRACE_PAGE_SIZE];
+  uint8_t pages = 0;
+  uint8_t count;
+  uint8_t *address;
+  while (trace_count)
+  {
+    count = (trace_count < TRACE_PAGE_EVENTS) ? trace_count : TRACE_PAGE_EVENTS;
+    for (uint8_t index = 0; index < count; index++)
+    {
+      const SavePowerTraceEvent &event = trace_events[(trace_head + index) & (SAVEPOWER_TRACE_EVENTS - 1)];
+      uint8_t *bytes = page + TRACE_PAGE_HEADER + index * TRACE_EVENT_BYTES;
+      bytes[0] = event.time_ms;
+      bytes[1] = event.time_ms >> 8;
+      bytes[2] = event.time_ms >> 16;
+      bytes[3] = event.time_ms >> 24;
+      bytes[4] = event.type;
+      bytes[5] = event.value;
+    }
+    page[0] = trace_sequence;
+    page[1] = trace_sequence >> 8;
+    page[2] = count;
+    page[3] = trace_lost;
+    page[TRACE_PAGE_HEADER - 1] = TracePageChecksum(page, count);
+    address = (uint8_t *)(uintptr_t)(SAVEPOWER_TRACE_EEPROM_START + trace_page * SAVEPOWER_TRACE_PAGE_SIZE);
+    eeprom_update_block(page + TRACE_PAGE_HEADER, address + TRACE_PAGE_HEADER, count * TRACE_EVENT_BYTES);
+    eeprom_update_block(page, address, TRACE_PAGE_HEADER);
+    trace_head = (trace_head + count) & (SAVEPOWER_TRACE_EVENTS - 1);
+    trace_count -= count;
+    trace_lost = 0;
+    trace_sequence++;
+    trace_page = (trace_page + 1) % SAVEPOWER_TRACE_PAGES;
+    pages++;
+  }
+  return pages;
+}
+
+// Taking the oldest event kept in RAM (to send it over a serial link instead of flushing it to EEPROM)
+bool SavePowerClass::ReadTraceEvent(SavePowerTraceEvent &event)
+{
+  if (!trace_count) return false;
+  event = trace_events[trace_head];
+  trace_head = (trace_head + 1) & (SAVEPOWER_TRACE_EVENTS - 1);
+  trace_count--;
+  return true;
+}
+
+// Invalidating every trace page in EEPROM, the next flush starts again from the first page
+void SavePowerClass::ClearTrace()
+{
+  for (uint8_t index = 0; index < SAVEPOWER_TRACE_PAGES; index++)
+  {
+    eeprom_update_byte((uint8_t *)(uintptr_t)(SAVEPOWER_TRACE_EEPROM_START + index * SAVEPOWER_TRACE_PAGE_SIZE + 2), 0xFF);
+  }
+  trace_page = 0;
+  trace_sequence = 0;
+}
+
+// Log buffer over a user provided storage, flushed at 3/4 full and before any sleep of 1s or more by default
+SavePowerLog::SavePowerLog(Stream &port, uint8_t *buffer, uint16_t size, Power_Domain_Value domain)
+  : log_port(port), log_buffer(buffer), log_size(size), log_head(0), log_count(0), log_threshold(size - (size >> 2)), 
+    log_max_delay_ms(0), log_long_sleep_ms(1000), log_oldest_ms(0), log_domain(domain), log_registered(false)
+{
+  if (log_buffer_count >= SAVEPOWER_LOG_BUFFERS) return;
+  log_buffers[log_buffer_count++] = this;
+  log_registered = true;
+  log_sleep_hook = LogsFlushBeforeSleep;
+}
+
+// Taking the log out of the buffers checked before every sleep, so a log going out of scope leaves no dangling pointer behind
+SavePowerLog::~SavePowerLog()
+{
+  uint8_t index;
+  if (!log_registered) return;
+  for (index = 0; index < log_buffer_count && log_buffers[index] != this; index++);
+  if (index == log_buffer_count) return;
+  log_buffer_count--;
+  for (; index < log_buffer_count; index++) log_buffers[index] = log_buffers[index + 1];
+}
+
+// False when the SAVEPOWER_LOG_BUFFERS slots were all used : the log is not flushed before the sleeps, Poll() and Flush() still work
+bool SavePowerLog::Registered()
+{
+  return log_registered;
+}
+
+// Flushing once threshold bytes are pending, once the oldest one waited max_delay_ms (0 for no deadline), and before any sleep of 
+// long_sleep_ms or more
+void SavePowerLog::SetFlushPolicy(uint16_t threshold, uint32_t max_delay_ms, uint32_t long_sleep_ms)
+{
+  log_threshold = (threshold && threshold <= log_size) ? threshold : log_size;
+  log_max_delay_ms = max_delay_ms;
+  log_long_sleep_ms = long_sleep_ms;
+  Poll();
+}
+
+// Collecting one byte
+size_t SavePowerLog::write(uint8_t value)
+{
+  return write(&value, 1);
+}
+
+// Collecting bytes, the buffer is drained when full and when the flush policy asks for it
+size_t SavePowerLog::write(const uint8_t *data, size_t length)
+{
+  size_t   written = 0;
+  uint16_t tail;
+  while (written < length)
+  {
+    if (log_count == log_size && !Flush()) break;
+    if (log_count == 0) log_oldest_ms = millis();
+    tail = log_head + log_count;
+    if (tail >= log_size) tail -= log_size;
+    log_buffer[tail] = data[written++];
+    log_count++;
+  }
+  Poll();
+  return written;
+}
+
+// Bytes waiting in the buffer
+uint16_t SavePowerLog::Pending()
+{
+  return log_count;
+}
+
+// Flushing when the fill threshold or the deadline of the oldest byte is reached
+bool SavePowerLog::Poll()
+{
+  if (!log_count) return false;
+  if (log_count >= log_threshold || (log_max_delay_ms && millis() - log_oldest_ms >= log_max_delay_ms)) return Flush();
+  return false;
+}
+
+// Powering the port up, sending everything in at most two writes, waiting for the end of the transmission and gating the port again 
+// (unless another user holds its power domain)
+bool SavePowerLog::Flush()
+{
+  uint16_t first;
+  if (!log_count) return false;
+  SavePower.AcquireDomain(log_domain);
+  SavePower.CommitDomains();
+  // Nothing can be sent on a suspended USB bus, the data waits for the resume
+  if (log_domain == DOMAIN_USB && SavePower.UsbSuspended())
+  {
+    SavePower.ReleaseDomain(log_domain);
+    SavePower.CommitDomains();
+    return false;
+  }
+  first = log_size - log_head;
+  if (first > log_count) first = log_count;
+  log_port.write(log_buffer + log_head, first);
+  if (log_count > first) log_port.write(log_buffer, log_count - first);
+  log_port.flush();
+  log_head = 0;
+  log_count = 0;
+  SavePower.ReleaseDomain(log_domain);
+  SavePower.CommitDomains();
+  return true;
+}
+
+// Flushing before a sleep of ms milliseconds when it is a long one, or when the oldest byte would miss its deadline meanwhile
+bool SavePowerLog::FlushBeforeSleep(uint32_t ms)
+{
+  uint32_t waited;
+  if (!log_count) return false;
+  if (ms >= log_long_sleep_ms) return Flush();
+  if (!log_max_delay_ms) return false;
+  waited = millis() - log_oldest_ms;
+  if (waited >= log_max_delay_ms || ms >= log_max_delay_ms - waited) return Flush();
+  return false;
+}
+
+// Compare match B of the SleepMicros() timer, weak so that another library can own the vector
+ISR (MICROS_COMPB_vect, __attribute__ ((weak)))
+{
+  micros_fired = 1;
+}
+
+// Conversion complete : waking ReadVcc() up, or handing the result to the sampling engine when SetSamplingChannels() linked it in
+ISR (ADC_vect, __attribute__ ((weak)))
+{
+  adc_converted = 1;
+  if (!adc_single && adc_sample_hook) adc_sample_hook();
+}
+
+// Pin change interrupt of PCINT0-7, weak so that another library can own the vector
+ISR (PCINT0_vect, __attribute__ ((weak)))
+{
+  PCICR &= ~(1 << PCIE0);
+  WakeSourceFired(WAKE_PCINT);
+}
+
+ISR (WDT_vect) 
+{
+  uint8_t mode = savepower_core.sleep_mode_current;
+  wdt_fired = 1;
+  wake_cause |= (1 << WAKE_WATCHDOG);
+  if (savepower_core.partial_pending) 
+  {
+    // The end of an interrupted period only adds its slept part, the time awake since the early wake up is already in millis()
+    uint32_t period_us = wdt_period_ms[partial_period] * 1000UL;
+    uint32_t awake_us = (micros() - partial_since_us) << clock_scale_shift;
+    partial_slept_us = (period_us > awake_us) ? period_us - awake_us : 0;
+    savepower_core.partial_pending = 0;
+    // The sketch is running : the slept part is only credited at the next sleep, millis() does not jump under its feet
+    if (mode == MODE_ACTIVE) partial_measured = 1;
+    else PartialSleepResolve(partial_slept_us);
+  }
+  else if (mode != MODE_ACTIVE && mode != MODE_IDLE) 
+  {
+    power_stats.residency_ms[mode] += wdt_period_ms[savepower_core.wdt_period_armed];
+    active_since_ms += wdt_period_ms[savepower_core.wdt_period_armed];
+    AddSleptMicros(wdt_period_ms[savepower_core.wdt_period_armed] * 1000UL);
+  }
+  if (mode != MODE_ACTIVE) power_stats.wakes[WAKE_WATCHDOG]++;
+  if (sleep_chaining) WatchdogChainNext();
+  else if (savepower_core.wdt_tick_armed) 
+  {
+    if (++wdt_tick_count >= wdt_tick_every)
+    {
+      wdt_tick_count = 0;
+      if (wdt_tick_callback) wdt_tick_callback();
+    }
+  }
+  else if (wdt_ticking) WatchdogTickArm();
+  else if (!(WDTCSR & (1 << WDE))) WatchdogDisarm();
+}
 
 #else
   #error "Make sure that the microcontroller is ATMega32U4 or ATMega16u4. This library supports just these two microcontrollers."
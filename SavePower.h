@@ -1,43 +1,281 @@
 #ifndef SavePower_h
 #define SavePower_h
-#include "Arduino.h"
+#if defined (SAVEPOWER_HOST_EMULATION)
+  #include "SavePowerEmulation.h"
+#else
+  #include "Arduino.h"
+  #include <avr/sleep.h>
+  #include <avr/wdt.h>
+#endif
+
+ // Analog Comparator ACSR bit
+ #ifndef ACD
+  #define ACD 7
+ #endif
+ 
+ // Analog Comparator power reduction macros
+ #ifndef disable_ac          
+  #define disable_ac() {       \
+  	 ACSR |= (1 << ACD);   \
+  } 									
+ #endif
+
+ #ifndef enable_ac          
+  #define enable_ac() {         \
+  	 ACSR &= ~(1 << ACD);   \
+  } 									
+ #endif
+ 
+ // Timer4 PRR bit 
+ #ifndef PRTIM4
+  #define PRTIM4 4
+ #endif
+
+ // avr/wdt.h defines the Watchdog time-outs as macros with the same values as Time_Out_Value, the enum takes the names over
+ #undef WDTO_15MS
+ #undef WDTO_30MS
+ #undef WDTO_60MS
+ #undef WDTO_120MS
+ #undef WDTO_250MS
+ #undef WDTO_500MS
+ #undef WDTO_1S
+ #undef WDTO_2S
+ #undef WDTO_4S
+ #undef WDTO_8S
 
 enum Time_Out_Value { WDTO_15MS, WDTO_30MS, WDTO_60MS, WDTO_120MS, WDTO_250MS, WDTO_500MS, WDTO_1S, WDTO_2S, WDTO_4S, WDTO_8S, SLEEP_FOREVER };
 
+enum Sleep_Mode_Value { MODE_IDLE, MODE_ADC_NOISE_REDUCTION, MODE_POWER_DOWN, MODE_POWER_SAVE, MODE_STANDBY, MODE_EXTENDED_STANDBY, MODE_ACTIVE };
+
+// Clocks and wake up sources a sleep must keep, used by the SleepUntil() governor
+enum Sleep_Constraint_Value
+{
+  NEED_NOTHING     = 0x00,
+  NEED_USART1      = 0x01,
+  NEED_TIMERS      = 0x02,
+  NEED_SPI         = 0x04,
+  NEED_USB         = 0x08,
+  NEED_ADC         = 0x10,
+  NEED_OSCILLATOR  = 0x20,
+  NEED_TWI_ADDRESS = 0x40
+};
+
+enum Power_Domain_Value { DOMAIN_SPI, DOMAIN_TWI, DOMAIN_ADC, DOMAIN_USART1, DOMAIN_USB, DOMAIN_TIMER0, DOMAIN_TIMER1, DOMAIN_TIMER3, 
+                          DOMAIN_TIMER4, POWER_DOMAINS };
+
+// Battery policy entry, the table is sorted from the highest min_mv down : the first entry at or below the measured VCC applies
+struct SavePowerVccPolicy
+{
+  uint16_t min_mv;
+  uint8_t  sleep_multiplier;
+  uint16_t clock_division;
+  uint16_t dropped_domains;
+};
+
+// System clock sources : the external crystal (F_CPU) or the internal 8MHz RC oscillator
+enum Clock_Source_Value { CLOCK_EXTERNAL, CLOCK_RC };
+
+// Clock tree latencies measured by the library, in microseconds (0 until measured)
+struct SavePowerClockLatency
+{
+  uint16_t pll_lock_us;
+  uint16_t rc_startup_us;
+  uint16_t crystal_startup_us;
+};
+
+// State given to a pin while the MCU sleeps : left as it is, driven low, input with pull-up, or input with its digital buffer disabled
+enum Pin_Sleep_Value { PIN_KEEP, PIN_OUTPUT_LOW, PIN_PULLUP, PIN_ANALOG };
+
+// Peripheral state saved before a deep sleep and restored on wake up
+struct SavePowerSnapshot
+{
+  uint8_t prr0;
+  uint8_t prr1;
+  uint8_t adcsra;
+  uint8_t adcsrb;
+  uint8_t admux;
+  uint8_t acsr;
+  uint8_t didr0;
+  uint8_t didr1;
+  uint8_t didr2;
+};
+
+// Wake up sources, WAKE_INTERRUPT stands for any interrupt not registered with AttachWakeSource() (Timer0 tick in Idle for example)
+enum Wake_Source_Value { WAKE_WATCHDOG, WAKE_INTERRUPT, WAKE_INT0, WAKE_INT1, WAKE_INT2, WAKE_INT3, WAKE_INT6, WAKE_PCINT, WAKE_USB, 
+                         WAKE_USART1, WAKE_SOURCES };
+
+// Power trace events : a sleep (value is the Sleep_Mode_Value), a wake up (value is the Wake_Source_Value, TRACE_WAKE_TIMER for the end 
+// of SleepMicros()), a new PRR0 or PRR1 value, a new clock (value is the division of F_CPU as a power of two, plus 0x80 on the RC 
+// oscillator), and the start of the trace (value is MCUSR, the reset flags)
+enum Trace_Event_Value { TRACE_START, TRACE_SLEEP, TRACE_WAKE, TRACE_PRR0, TRACE_PRR1, TRACE_CLOCK };
+
+ #ifndef TRACE_WAKE_TIMER
+  #define TRACE_WAKE_TIMER 0xFF
+ #endif
+
+// Power trace event, time_ms is millis() (corrected for the time slept)
+struct SavePowerTraceEvent
+{
+  uint32_t time_ms;
+  uint8_t  type;
+  uint8_t  value;
+};
+
+// Energy accounting snapshot : time spent in each mode (indexed by Sleep_Mode_Value), wakes per source and estimated charge
+struct SavePowerStats
+{
+  uint32_t residency_ms[MODE_ACTIVE + 1];
+  uint16_t wakes[WAKE_SOURCES];
+  float    charge_uAh;
+};
+
+// Library state shared with the inline Sleep<>(), Enable<>() and Disable<>() methods below, not meant to be used by the sketch
+struct SavePowerCoreState
+{
+  volatile uint8_t sleep_mode_current;
+  volatile uint8_t wdt_period_armed;
+  volatile uint8_t wdt_tick_armed;
+  volatile uint8_t partial_pending;
+  uint16_t         domain_stale;
+};
+
+extern SavePowerCoreState savepower_core;
+
+// Running the re-initialisation hooks of the given domains (1 << Power_Domain_Value) stopped since their last use
+void SavePowerReinitDomains(uint16_t domains);
+// Marking the domains whose clock is being stopped (given as PRR0/PRR1 bits going from 0 to 1) as needing a re-initialisation
+void SavePowerDomainsStopped(uint8_t prr0_bits, uint8_t prr1_bits);
+// Crediting the slept part of a Watchdog period interrupted by an early wake up before the period is re-armed (interrupts disabled)
+void SavePowerPartialSleepEstimate();
+
 class SavePowerClass
 {
 	public:
 		#if defined (__AVR_ATmega32U4__) || defined (__AVR_ATmega16U4__) 
 		        void  DivideClockSpeed(int Clock_Division_Factor);
+			void  ScaleClockSpeed(int Clock_Division_Factor);
+			void  Delay(uint32_t ms);
+			bool  SelectClockSource(Clock_Source_Value source);
+			bool  StopPLL();
+			uint16_t  StartPLL();
+			void  SetPLLSleepStop(bool stop);
+			SavePowerClockLatency  GetClockLatency();
+			static constexpr uint8_t  ClockDivisionBits(int Clock_Division_Factor) 
+			{ 
+			  return (Clock_Division_Factor <= 1) ? 0 : 1 + ClockDivisionBits(Clock_Division_Factor >> 1); 
+			}
 		        void  IdleMode(Time_Out_Value time);		          
 			void  ADCNoiseReductionMode(Time_Out_Value time);
 			void  PowerDownMode(Time_Out_Value time);
 			void  PowerSaveMode(Time_Out_Value time);
 			void  StandbyMode(Time_Out_Value time);
 			void  ExtendedStandbyMode(Time_Out_Value time);  
+			template <Sleep_Mode_Value Mode, Time_Out_Value Time = SLEEP_FOREVER> 
+			void  Sleep();
+			template <Power_Domain_Value... Domains> 
+			void  Disable();
+			template <Power_Domain_Value... Domains> 
+			void  Enable();
 			void  DisableAllModules();
-			void  DisableSPI();
-			void  DisableUSB();
-			void  DisableADC();
-			void  DisableAC();
-			void  DisableUSART();
-			void  DisableTWI();
-			void  DisableTimer0();
-			void  DisableTimer1();
-			void  DisableTimer3();
-			void  DisableTimer4();
+			void  DisableSPI()    { Disable<DOMAIN_SPI>(); }
+			void  DisableUSB()    { Disable<DOMAIN_USB>(); }
+			void  DisableADC()    { Disable<DOMAIN_ADC>(); }
+			void  DisableAC()     { disable_ac(); }
+			void  DisableUSART()  { Disable<DOMAIN_USART1>(); }
+			void  DisableTWI()    { Disable<DOMAIN_TWI>(); }
+			void  DisableTimer0() { Disable<DOMAIN_TIMER0>(); }
+			void  DisableTimer1() { Disable<DOMAIN_TIMER1>(); }
+			void  DisableTimer3() { Disable<DOMAIN_TIMER3>(); }
+			void  DisableTimer4() { Disable<DOMAIN_TIMER4>(); }
 			void  EnableAllModules(); 
-			void  EnableSPI();   
-			void  EnableUSB();
-			void  EnableADC();
-			void  EnableAC();
-			void  EnableUSART();
-			void  EnableTWI();
-			void  EnableTimer0();
-			void  EnableTimer1();
-			void  EnableTimer3();
-			void  EnableTimer4();      
+			void  EnableSPI()     { Enable<DOMAIN_SPI>(); }
+			void  EnableUSB()     { Enable<DOMAIN_USB>(); }
+			void  EnableADC()     { Enable<DOMAIN_ADC>(); }
+			void  EnableAC()      { enable_ac(); }
+			void  EnableUSART()   { Enable<DOMAIN_USART1>(); }
+			void  EnableTWI()     { Enable<DOMAIN_TWI>(); }
+			void  EnableTimer0()  { Enable<DOMAIN_TIMER0>(); }
+			void  EnableTimer1()  { Enable<DOMAIN_TIMER1>(); }
+			void  EnableTimer3()  { Enable<DOMAIN_TIMER3>(); }
+			void  EnableTimer4()  { Enable<DOMAIN_TIMER4>(); }
 			void  LowestConsumption(Time_Out_Value time);    
+			void  SleepFor(uint32_t ms, Sleep_Mode_Value mode = MODE_POWER_DOWN);
+			void  SleepMicros(uint32_t us, uint16_t domains = 0);
+			bool  UsbSuspended();
+			bool  SleepWhileUsbSuspended();
+			uint16_t  CalibrateWatchdog();
+			void  SetWatchdogCalibration(uint16_t factor);
+			uint32_t  Now();
+			Sleep_Mode_Value  SleepUntil(uint32_t deadline, uint8_t constraints = NEED_NOTHING);
+			SavePowerStats  GetPowerStats();
+			void  ResetPowerStats();
+			void  SetModeCurrent(Sleep_Mode_Value mode, uint16_t current_uA);
+			void  AcquireDomain(Power_Domain_Value domain);
+			void  ReleaseDomain(Power_Domain_Value domain);
+			void  CommitDomains();
+			void  SaveState(SavePowerSnapshot &snapshot);
+			void  RestoreState(const SavePowerSnapshot &snapshot);
+			void  SetReinitHook(Power_Domain_Value domain, void (*hook)());
+			void  AttachWakeSource(Wake_Source_Value source, void (*callback)() = 0, uint8_t mode = LOW);
+			void  AttachWakeSource(Stream &port, void (*callback)() = 0);
+			void  DetachWakeSource(Wake_Source_Value source);
+			uint16_t  LastWakeCause();
+			void  StartWatchdogTick(Time_Out_Value period, uint16_t ticks, void (*callback)());
+			void  StopWatchdogTick();
+			void  SetSamplingChannels(const uint8_t *channels, uint8_t count, uint8_t oversampling_bits = 0);
+			uint16_t  SampleBurst(uint16_t results);
+			uint8_t  SamplesAvailable();
+			bool  ReadSample(uint16_t &value, uint8_t &channel);
+			uint16_t  ReadVcc();
+			void  SetVccPolicy(const SavePowerVccPolicy *table, uint8_t count, uint32_t cadence_ms);
+			const SavePowerVccPolicy*  UpdateVccPolicy();
+			void  AdaptiveSleepFor(uint32_t ms, Sleep_Mode_Value mode = MODE_POWER_DOWN);
+			void  SetPinSleepPolicy(uint8_t pin, Pin_Sleep_Value policy);
+			void  ApplyPinSleepPlan();
+			void  RestorePinState();
+			uint8_t  AddTask(void (*task)(), uint32_t period_ms, uint16_t slack_ms = 0, uint16_t domains = 0, 
+			                 uint8_t constraints = NEED_NOTHING);
+			void  ScheduleTask(uint8_t task, uint32_t deadline);
+			void  RemoveTask(uint8_t task);
+			Sleep_Mode_Value  RunTasks();
+			void  StartTrace();
+			void  StopTrace();
+			uint8_t  FlushTrace();
+			bool  ReadTraceEvent(SavePowerTraceEvent &event);
+			void  ClearTrace();
+			// SMCR sleep mode bits of a sleep mode
+			static constexpr uint8_t  SleepModeBits(Sleep_Mode_Value mode)
+			{
+			  return (mode == MODE_IDLE) ? SLEEP_MODE_IDLE : (mode == MODE_ADC_NOISE_REDUCTION) ? SLEEP_MODE_ADC : 
+			         (mode == MODE_POWER_DOWN) ? SLEEP_MODE_PWR_DOWN : (mode == MODE_POWER_SAVE) ? SLEEP_MODE_PWR_SAVE : 
+			         (mode == MODE_STANDBY) ? SLEEP_MODE_STANDBY : SLEEP_MODE_EXT_STANDBY;
+			}
+			// WDTCSR prescaler bits (WDP3:0) of a Watchdog time-out value
+			static constexpr uint8_t  WatchdogPrescalerBits(Time_Out_Value time)
+			{
+			  return (time & 0x07) | ((time & 0x08) ? (1 << WDP3) : 0);
+			}
+			// Mask (1 << Power_Domain_Value) of a list of power domains
+			static constexpr uint16_t  DomainMask() { return 0; }
+			template <typename... Others>
+			static constexpr uint16_t  DomainMask(Power_Domain_Value domain, Others... others) 
+			{ 
+			  return (1 << domain) | DomainMask(others...); 
+			}
+			// PRR0 (prr = 0) or PRR1 (prr = 1) bits of a mask of power domains
+			static constexpr uint8_t  DomainPRRBits(uint16_t domains, uint8_t prr, uint8_t domain = 0)
+			{
+			  return (domain >= POWER_DOMAINS) ? 0 : 
+			         ((((domains >> domain) & 1) ? DomainPRRBit((Power_Domain_Value)domain, prr) : 0) | DomainPRRBits(domains, prr, domain + 1));
+			}
+			static constexpr uint8_t  DomainPRRBit(Power_Domain_Value domain, uint8_t prr)
+			{
+			  return (prr == 0) ? ((domain == DOMAIN_SPI) ? (1 << PRSPI) : (domain == DOMAIN_TWI) ? (1 << PRTWI) : 
+			                       (domain == DOMAIN_ADC) ? (1 << PRADC) : (domain == DOMAIN_TIMER0) ? (1 << PRTIM0) : 
+			                       (domain == DOMAIN_TIMER1) ? (1 << PRTIM1) : 0) :
+			                      ((domain == DOMAIN_USART1) ? (1 << PRUSART1) : (domain == DOMAIN_USB) ? (1 << PRUSB) : 
+			                       (domain == DOMAIN_TIMER3) ? (1 << PRTIM3) : (domain == DOMAIN_TIMER4) ? (1 << PRTIM4) : 0);
+			}
 		#else
 		    #error "Make sure that the microcontroller is ATMega32U4 or ATMega16u4. This library supports only these two microcontrollers."
 		#endif			
@@ -45,4 +283,120 @@ class SavePowerClass
 
 extern SavePowerClass SavePower;
 
+// Outgoing log buffer : the writes are collected in RAM while the port (USART1 or USB) is clock-gated, and drained in one burst with 
+// the port powered up through its power domain. Example : static uint8_t storage[256]; SavePowerLog Log(Serial1, storage, 256);
+class SavePowerLog : public Print
+{
+	public:
+		SavePowerLog(Stream &port, uint8_t *buffer, uint16_t size, Power_Domain_Value domain = DOMAIN_USART1);
+		~SavePowerLog();
+		void  SetFlushPolicy(uint16_t threshold, uint32_t max_delay_ms, uint32_t long_sleep_ms);
+		size_t  write(uint8_t value);
+		size_t  write(const uint8_t *data, size_t length);
+		using Print::write;
+		uint16_t  Pending();
+		bool  Poll();
+		bool  Flush();
+		bool  FlushBeforeSleep(uint32_t ms);
+		bool  Registered();
+	private:
+		Stream   &log_port;
+		uint8_t  *log_buffer;
+		uint16_t log_size;
+		uint16_t log_head;
+		uint16_t log_count;
+		uint16_t log_threshold;
+		uint32_t log_max_delay_ms;
+		uint32_t log_long_sleep_ms;
+		uint32_t log_oldest_ms;
+		Power_Domain_Value log_domain;
+		bool     log_registered;
+};
+
+#if defined (__AVR_ATmega32U4__) || defined (__AVR_ATmega16U4__) 
+
+// Sleeping with the mode and the time-out value known at compile time : the SMCR and WDTCSR values are constants, there is no 
+// SLEEP_FOREVER branch and no table lookup, only the register writes. The Watchdog interrupt still adds the time slept to millis(). 
+template <Sleep_Mode_Value Mode, Time_Out_Value Time>
+inline void SavePowerClass::Sleep()
+{
+  static_assert(Mode < MODE_ACTIVE, "Sleep<>() needs a sleep mode");
+  cli();
+  if (Time != SLEEP_FOREVER)
+  {
+    if (savepower_core.partial_pending) SavePowerPartialSleepEstimate();
+    savepower_core.wdt_period_armed = Time;
+    savepower_core.wdt_tick_armed = 0;
+    wdt_reset();
+    MCUSR &= ~(1 << WDRF);
+    WDTCSR = (1 << WDCE) | (1 << WDE);
+    WDTCSR = (1 << WDIE) | WatchdogPrescalerBits(Time);
+  }
+  savepower_core.sleep_mode_current = Mode;
+  SMCR = SleepModeBits(Mode) | (1 << SE);
+  sei();
+  sleep_cpu();
+  SMCR = 0;
+  savepower_core.sleep_mode_current = MODE_ACTIVE;
+}
+
+// Stopping the clock of the given domains with a single write per PRR register
+template <Power_Domain_Value... Domains>
+inline void SavePowerClass::Disable()
+{
+  constexpr uint16_t domains = DomainMask(Domains...);
+  constexpr uint8_t  prr0_bits = DomainPRRBits(domains, 0);
+  constexpr uint8_t  prr1_bits = DomainPRRBits(domains, 1);
+  uint8_t prr0 = 0xFF;
+  uint8_t prr1 = 0xFF;
+  if (domains & (1 << DOMAIN_ADC)) ADCSRA &= ~(1 << ADEN);
+  if (prr0_bits)
+  {
+    prr0 = PRR0;
+    PRR0 = prr0 | prr0_bits;
+  }
+  if (prr1_bits)
+  {
+    prr1 = PRR1;
+    PRR1 = prr1 | prr1_bits;
+  }
+  // The domains running until now are marked stale, as DisableAllModules() and CommitDomains() do
+  if ((prr0_bits & ~prr0) || (prr1_bits & ~prr1)) SavePowerDomainsStopped(prr0_bits & ~prr0, prr1_bits & ~prr1);
+}
+
+// Starting the clock of the given domains with a single write per PRR register, their hooks run if they lost their state
+template <Power_Domain_Value... Domains>
+inline void SavePowerClass::Enable()
+{
+  constexpr uint16_t domains = DomainMask(Domains...);
+  if (DomainPRRBits(domains, 0)) PRR0 &= ~DomainPRRBits(domains, 0);
+  if (DomainPRRBits(domains, 1)) PRR1 &= ~DomainPRRBits(domains, 1);
+  if (domains & (1 << DOMAIN_ADC)) ADCSRA |= (1 << ADEN);
+  if (savepower_core.domain_stale & domains) SavePowerReinitDomains(domains);
+}
+
+#endif
+
+// Scoped power domains : the peripherals are powered up for the lifetime of the guard, with a single write per PRR register, 
+// and gated again when the last guard using them goes out of scope. Example : PowerGuard<DOMAIN_SPI, DOMAIN_TWI> guard;
+template <Power_Domain_Value... Domains>
+class PowerGuard
+{
+	public:
+		PowerGuard()
+		{
+		  int acquire[] = { 0, (SavePower.AcquireDomain(Domains), 0)... };
+		  (void)acquire;
+		  SavePower.CommitDomains();
+		}
+		~PowerGuard()
+		{
+		  int release[] = { 0, (SavePower.ReleaseDomain(Domains), 0)... };
+		  (void)release;
+		  SavePower.CommitDomains();
+		}
+		PowerGuard(const PowerGuard&) = delete;
+		PowerGuard& operator=(const PowerGuard&) = delete;
+};
+
 #endif
@@ -0,0 +1,979 @@
+/****************************************************************************************
+* ATMega32U4/16U4 SavePower Library - Host Register Emulation
+* Chips Emulated: ATMega32u4 (register file, sleep controller, Watchdog, CLKPR, Timer0, USART1 baud rate)
+*****************************************************************************************/
+
+/***********************************************************************************************************************************************
+Building the library with -DSAVEPOWER_HOST_EMULATION on a Linux host replaces Arduino.h, avr/io.h, avr/sleep.h, avr/wdt.h, avr/eeprom.h and
+avr/interrupt.h by this file. Every Special Function Register the library touches lives in an emulated register file, and every access is
+logged (address, read or write, value) so a host program can check the exact register sequence of any SavePowerClass method, and count the
+reads and writes on the sleep/wake path.
+
+The emulation also models the parts of the hardware the library depends on :
+  ===> The timed sequences of WDTCSR (WDCE) and CLKPR (CLKPCE). A protected write outside its four cycle window is ignored, just like the
+       silicon does, and counted in timed_sequence_errors. The window is emulated as the next register access.
+  ===> The Watchdog oscillator (16ms << WDP at 128kHz, scaled by wdt_scale to emulate an inaccurate oscillator), its interrupt and reset
+       modes, and the hardware clearing of WDIE in interrupt and system reset mode.
+  ===> Timer0 and the Arduino core timekeeping (timer0_millis, timer0_overflow_count), which only run while clkIO runs, so the millis()
+       drift across Power Down sleeps is reproduced.
+  ===> sleep_cpu(), which jumps the emulated time to the next wake up event (Watchdog, Timer0 overflow in Idle, or an event scheduled by
+       the host program with schedule_event()) and runs the matching interrupt.
+
+Every register access costs one emulated CPU cycle, and the Arduino time functions cost a few tens of cycles. Real instruction counts are
+out of reach of a host build, so the access counters are the cost metric of the emulation.
+***********************************************************************************************************************************************/
+
+#ifndef SavePowerEmulation_h
+#define SavePowerEmulation_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef __AVR_ATmega32U4__
+ #define __AVR_ATmega32U4__ 1
+#endif
+
+#ifndef F_CPU
+ #define F_CPU 16000000UL
+#endif
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+// Interrupt vectors defined by the library
+#define WDT_vect            savepower_WDT_vect
+#define PCINT0_vect         savepower_PCINT0_vect
+#define ADC_vect            savepower_ADC_vect
+#define TIMER1_COMPB_vect   savepower_TIMER1_COMPB_vect
+#define TIMER3_COMPB_vect   savepower_TIMER3_COMPB_vect
+
+#define ISR(vector, ...)    extern "C" void vector(void) __VA_ARGS__; extern "C" void vector(void)
+
+extern "C" void savepower_WDT_vect(void);
+extern "C" void savepower_PCINT0_vect(void);
+extern "C" void savepower_ADC_vect(void);
+// Only the vector of the SleepMicros() timer is defined by the library
+extern "C" void savepower_TIMER1_COMPB_vect(void) __attribute__ ((weak));
+extern "C" void savepower_TIMER3_COMPB_vect(void) __attribute__ ((weak));
+
+namespace SavePowerEmulation
+{
+  // Data space addresses of the emulated registers (ATMega32u4 register summary)
+  enum Register_Address
+  {
+    ADDRESS_DDRB   = 0x24, ADDRESS_PORTB  = 0x25, ADDRESS_DDRC   = 0x27, ADDRESS_PORTC  = 0x28, ADDRESS_DDRD   = 0x2A, ADDRESS_PORTD  = 0x2B,
+    ADDRESS_DDRE   = 0x2D, ADDRESS_PORTE  = 0x2E, ADDRESS_DDRF   = 0x30, ADDRESS_PORTF  = 0x31,
+    ADDRESS_TIFR0  = 0x35, ADDRESS_TIFR1  = 0x36, ADDRESS_TIFR3  = 0x38, ADDRESS_PCIFR  = 0x3B, ADDRESS_EIFR   = 0x3C, ADDRESS_EIMSK  = 0x3D, ADDRESS_TCCR0B = 0x45, ADDRESS_TCNT0  = 0x46, ADDRESS_ACSR   = 0x50, ADDRESS_SMCR   = 0x53,
+    ADDRESS_MCUSR  = 0x54, ADDRESS_SREG   = 0x5F, ADDRESS_WDTCSR = 0x60, ADDRESS_CLKPR  = 0x61, ADDRESS_PRR0   = 0x64,
+    ADDRESS_PRR1   = 0x65, ADDRESS_PCICR  = 0x68, ADDRESS_PCMSK0 = 0x6B, ADDRESS_PLLCSR = 0x49, ADDRESS_PLLFRQ = 0x52, ADDRESS_TIMSK0 = 0x6E, ADDRESS_TIMSK1 = 0x6F, ADDRESS_TIMSK3 = 0x71, ADDRESS_ADCL   = 0x78, ADDRESS_ADCH   = 0x79, ADDRESS_ADCSRA = 0x7A, ADDRESS_ADCSRB = 0x7B,
+    ADDRESS_ADMUX  = 0x7C, ADDRESS_DIDR2  = 0x7D, ADDRESS_DIDR0  = 0x7E, ADDRESS_DIDR1  = 0x7F, ADDRESS_TCCR1A = 0x80, ADDRESS_TCCR1B = 0x81, ADDRESS_TCNT1L = 0x84, ADDRESS_TCNT1H = 0x85, ADDRESS_OCR1BL = 0x8A,
+    ADDRESS_OCR1BH = 0x8B, ADDRESS_TCCR3A = 0x90, ADDRESS_TCCR3B = 0x91, ADDRESS_TCNT3L = 0x94, ADDRESS_TCNT3H = 0x95, ADDRESS_OCR3BL = 0x9A,
+    ADDRESS_OCR3BH = 0x9B, ADDRESS_UCSR1A = 0xC8, ADDRESS_UCSR1B = 0xC9,
+    ADDRESS_UBRR1L = 0xCC, ADDRESS_UBRR1H = 0xCD, ADDRESS_CLKSEL0 = 0xC5, ADDRESS_CLKSEL1 = 0xC6, ADDRESS_CLKSTA = 0xC7,
+    ADDRESS_USBCON = 0xD8, ADDRESS_UDINT  = 0xE1, ADDRESS_UDIEN  = 0xE2
+  };
+
+  enum Access_Type { REGISTER_READ, REGISTER_WRITE, SLEEP_CPU, WATCHDOG_RESET };
+
+  struct Access
+  {
+    uint8_t address;
+    uint8_t type;
+    uint8_t value;
+  };
+
+  const uint16_t LOG_SIZE = 2048;
+
+  struct Event
+  {
+    uint64_t time_ns;
+    void (*handler)();
+  };
+
+  struct State
+  {
+    uint8_t  registers[256];
+    Access   log[LOG_SIZE];
+    uint16_t log_count;
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t sleeps;
+    uint32_t resets;
+    uint32_t timed_sequence_errors;
+    uint64_t time_ns;
+    uint64_t wdt_deadline_ns;
+    uint64_t timer0_fraction_ns;
+    uint8_t  wdce_window;
+    uint8_t  clkpce_window;
+    uint8_t  timer0_fract;
+    uint8_t  sleeping;
+    double   wdt_scale;
+    Event    event;
+    void     (*int_handlers[5])();
+    uint64_t adc_deadline_ns;
+    uint16_t (*adc_input)(uint8_t mux);
+    uint32_t conversions;
+    uint64_t compb_deadline_ns[2];
+    uint64_t pll_lock_ns;
+    uint64_t rc_on_ns;
+    uint64_t ext_on_ns;
+  };
+
+  inline State& state() { static State s; return s; }
+
+  void write(uint8_t address, uint8_t value);
+  uint8_t read(uint8_t address);
+}
+
+// Arduino core timekeeping, updated by the emulated Timer0 overflow interrupt
+inline volatile unsigned long timer0_millis = 0;
+inline volatile unsigned long timer0_overflow_count = 0;
+
+namespace SavePowerEmulation
+{
+  class Register
+  {
+    public:
+      explicit Register(uint8_t address) : address(address) {}
+      operator uint8_t() const { return read(address); }
+      Register& operator=(int value) { write(address, (uint8_t)value); return *this; }
+      Register& operator=(const Register& other) { write(address, (uint8_t)other); return *this; }
+      Register& operator|=(int value) { write(address, read(address) | value); return *this; }
+      Register& operator&=(int value) { write(address, read(address) & value); return *this; }
+      Register& operator^=(int value) { write(address, read(address) ^ value); return *this; }
+      class RegisterPointer operator&() const;
+    private:
+      uint8_t address;
+  };
+
+  // What &DDRB gives, so that a table of registers reads like the volatile uint8_t * of avr/io.h : *pointer is the register again
+  class RegisterPointer
+  {
+    public:
+      explicit RegisterPointer(uint8_t address) : address(address) {}
+      Register operator*() const { return Register(address); }
+    private:
+      uint8_t address;
+  };
+
+  inline RegisterPointer Register::operator&() const { return RegisterPointer(address); }
+
+  // 16-bit register pair, the high byte goes through the TEMP register : written first, read last
+  class Register16
+  {
+    public:
+      explicit Register16(uint8_t address) : address(address) {}
+      operator uint16_t() const { uint8_t low = read(address); return low | (read(address + 1) << 8); }
+      Register16& operator=(int value) { write(address + 1, (uint8_t)(value >> 8)); write(address, (uint8_t)value); return *this; }
+    private:
+      uint8_t address;
+  };
+
+  inline void record(uint8_t address, uint8_t type, uint8_t value)
+  {
+    State& s = state();
+    if (s.log_count < LOG_SIZE)
+    {
+      s.log[s.log_count].address = address;
+      s.log[s.log_count].type = type;
+      s.log[s.log_count].value = value;
+      s.log_count++;
+    }
+  }
+
+  inline bool interrupts_enabled() { return state().registers[ADDRESS_SREG] & 0x80; }
+
+  inline bool watchdog_running()
+  {
+    return state().registers[ADDRESS_WDTCSR] & ((1 << 6) | (1 << 3));
+  }
+
+  inline uint64_t watchdog_period_ns()
+  {
+    uint8_t  wdtcsr = state().registers[ADDRESS_WDTCSR];
+    uint8_t  wdp = (wdtcsr & 0x07) | ((wdtcsr & (1 << 5)) ? 0x08 : 0x00);
+    return (uint64_t)((16000000ULL << wdp) * state().wdt_scale);
+  }
+
+  inline void watchdog_restart()
+  {
+    State& s = state();
+    s.wdt_deadline_ns = watchdog_running() ? s.time_ns + watchdog_period_ns() : 0;
+  }
+
+  inline bool timer0_running()
+  {
+    State& s = state();
+    bool    clkio = !s.sleeping || (s.registers[ADDRESS_SMCR] & 0x0E) == 0x00;
+    return clkio && !(s.registers[ADDRESS_PRR0] & (1 << 5)) && (s.registers[ADDRESS_TCCR0B] & 0x07);
+  }
+
+  // System clock : the crystal (F_CPU) or the internal 8MHz RC oscillator as selected by CLKS, divided by the CLKPR prescaler
+  inline uint64_t clock_ns(uint64_t cycles)
+  {
+    State& s = state();
+    uint32_t source_hz = (s.registers[ADDRESS_CLKSEL0] & 0x01) ? F_CPU : 8000000UL;
+    return ((1000000000ULL * cycles) << (s.registers[ADDRESS_CLKPR] & 0x0F)) / source_hz;
+  }
+
+  inline uint64_t timer0_overflow_ns()
+  {
+    static const uint16_t prescaler[] = { 0, 1, 8, 64, 256, 1024, 1, 1 };
+    return clock_ns(256ULL * prescaler[state().registers[ADDRESS_TCCR0B] & 0x07]);
+  }
+
+  // Timer0 overflow interrupt of the Arduino core (wiring.c)
+  inline void timer0_overflow()
+  {
+    const unsigned long micros_per_overflow = (64UL * 256UL) / (F_CPU / 1000000UL);
+    State& s = state();
+    timer0_millis = timer0_millis + micros_per_overflow / 1000;
+    s.timer0_fract += (micros_per_overflow % 1000) >> 3;
+    if (s.timer0_fract >= 125)
+    {
+      s.timer0_fract -= 125;
+      timer0_millis = timer0_millis + 1;
+    }
+    timer0_overflow_count = timer0_overflow_count + 1;
+  }
+
+  inline void watchdog_timeout()
+  {
+    State& s = state();
+    uint8_t& wdtcsr = s.registers[ADDRESS_WDTCSR];
+    if (wdtcsr & (1 << 6))
+    {
+      wdtcsr |= (1 << 7);
+      if (wdtcsr & (1 << 3)) wdtcsr &= ~(1 << 6);
+      // The counter starts the next period right away, the interrupt handler must not see the time-out it is serving again
+      watchdog_restart();
+      if (interrupts_enabled())
+      {
+        wdtcsr &= ~(1 << 7);
+        s.registers[ADDRESS_SREG] &= ~0x80;
+        savepower_WDT_vect();
+        s.registers[ADDRESS_SREG] |= 0x80;
+      }
+    }
+    else if (wdtcsr & (1 << 3))
+    {
+      s.resets++;
+      record(ADDRESS_WDTCSR, WATCHDOG_RESET, wdtcsr);
+      wdtcsr = 0;
+      watchdog_restart();
+    }
+  }
+
+  // Conversion started by entering ADC Noise Reduction mode with the ADC enabled, 13 ADC clocks long
+  inline void adc_start()
+  {
+    State& s = state();
+    uint8_t adcsra = s.registers[ADDRESS_ADCSRA];
+    uint8_t adps = adcsra & 0x07;
+    if (s.adc_deadline_ns || !(adcsra & 0x80) || (s.registers[ADDRESS_PRR0] & 0x01)) return;
+    s.registers[ADDRESS_ADCSRA] |= (1 << 6);
+    s.adc_deadline_ns = s.time_ns + clock_ns(13UL << (adps ? adps : 1));
+  }
+
+  // Conversion complete : the result of the selected channel (MUX5:0) comes from adc_input, then ADC_vect runs if ADIE is set
+  inline void adc_complete()
+  {
+    State& s = state();
+    uint8_t  mux = (s.registers[ADDRESS_ADMUX] & 0x1F) | (s.registers[ADDRESS_ADCSRB] & 0x20);
+    uint16_t value = s.adc_input ? (s.adc_input(mux) & 0x3FF) : 0;
+    s.adc_deadline_ns = 0;
+    s.conversions++;
+    s.registers[ADDRESS_ADCL] = (uint8_t)value;
+    s.registers[ADDRESS_ADCH] = (uint8_t)(value >> 8);
+    s.registers[ADDRESS_ADCSRA] = (s.registers[ADDRESS_ADCSRA] & ~(1 << 6)) | (1 << 4);
+    if ((s.registers[ADDRESS_ADCSRA] & (1 << 3)) && interrupts_enabled())
+    {
+      s.registers[ADDRESS_ADCSRA] &= ~(1 << 4);
+      s.registers[ADDRESS_SREG] &= ~0x80;
+      savepower_ADC_vect();
+      s.registers[ADDRESS_SREG] |= 0x80;
+    }
+  }
+
+  // Timer1 (index 0) and Timer3 (index 1) : only the normal mode compare match B is emulated, from the TCCRnB write starting the timer
+  inline uint8_t timer16_base(uint8_t index) { return index ? 0x90 : 0x80; }
+
+  inline void timer16_start(uint8_t index)
+  {
+    static const uint16_t prescaler[] = { 0, 1, 8, 64, 256, 1024, 1, 1 };
+    State& s = state();
+    uint8_t  base = timer16_base(index);
+    uint8_t  cs = s.registers[base + 1] & 0x07;
+    uint16_t tcnt = s.registers[base + 4] | (s.registers[base + 5] << 8);
+    uint16_t ocrb = s.registers[base + 10] | (s.registers[base + 11] << 8);
+    uint32_t ticks = (uint16_t)(ocrb - tcnt) + 1;
+    s.compb_deadline_ns[index] = 0;
+    if (!prescaler[cs] || cs > 5) return;
+    s.compb_deadline_ns[index] = s.time_ns + clock_ns((uint64_t)ticks * prescaler[cs]);
+  }
+
+  inline void timer16_compb(uint8_t index)
+  {
+    State& s = state();
+    uint8_t tifr = index ? ADDRESS_TIFR3 : ADDRESS_TIFR1;
+    uint8_t timsk = index ? ADDRESS_TIMSK3 : ADDRESS_TIMSK1;
+    uint8_t prr = index ? s.registers[ADDRESS_PRR1] & (1 << 3) : s.registers[ADDRESS_PRR0] & (1 << 3);
+    s.compb_deadline_ns[index] = 0;
+    if (prr) return;
+    s.registers[tifr] |= (1 << 2);
+    if ((s.registers[timsk] & (1 << 2)) && interrupts_enabled())
+    {
+      s.registers[tifr] &= ~(1 << 2);
+      s.registers[ADDRESS_SREG] &= ~0x80;
+      void (*vector)() = index ? savepower_TIMER3_COMPB_vect : savepower_TIMER1_COMPB_vect;
+      if (vector) vector();
+      s.registers[ADDRESS_SREG] |= 0x80;
+    }
+  }
+
+  // Moving the emulated time forward, running Timer0 and the Watchdog on the way
+  inline void advance(uint64_t ns)
+  {
+    State& s = state();
+    uint64_t target = s.time_ns + ns;
+    while (s.time_ns < target)
+    {
+      uint64_t step = target - s.time_ns;
+      bool     wdt_due = s.wdt_deadline_ns && s.wdt_deadline_ns <= target;
+      bool     adc_due = s.adc_deadline_ns && s.adc_deadline_ns <= target && (!wdt_due || s.adc_deadline_ns < s.wdt_deadline_ns);
+      int8_t   compb_due = -1;
+      if (adc_due) wdt_due = false;
+      if (wdt_due) step = s.wdt_deadline_ns - s.time_ns;
+      if (adc_due) step = s.adc_deadline_ns - s.time_ns;
+      for (uint8_t index = 0; index < 2; index++)
+      {
+        if (s.compb_deadline_ns[index] && s.compb_deadline_ns[index] < s.time_ns + step)
+        {
+          step = s.compb_deadline_ns[index] - s.time_ns;
+          compb_due = index;
+          wdt_due = adc_due = false;
+        }
+      }
+      if (timer0_running())
+      {
+        uint64_t overflow_ns = timer0_overflow_ns();
+        uint64_t elapsed = s.timer0_fraction_ns + step;
+        s.timer0_fraction_ns = elapsed % overflow_ns;
+        for (uint64_t count = elapsed / overflow_ns; count; count--) timer0_overflow();
+        s.registers[ADDRESS_TCNT0] = (uint8_t)(s.timer0_fraction_ns * 256 / overflow_ns);
+      }
+      s.time_ns += step;
+      if (wdt_due) watchdog_timeout();
+      if (adc_due) adc_complete();
+      if (compb_due >= 0) timer16_compb(compb_due);
+      if (s.event.handler && s.event.time_ns <= s.time_ns && interrupts_enabled())
+      {
+        void (*handler)() = s.event.handler;
+        s.event.handler = 0;
+        handler();
+      }
+    }
+  }
+
+  inline void cycles(uint32_t count) { advance(clock_ns(count)); }
+
+  inline uint8_t read(uint8_t address)
+  {
+    State& s = state();
+    uint8_t value;
+    // PLOCK is set 100us after PLLE
+    if (address == ADDRESS_PLLCSR && s.pll_lock_ns && s.time_ns >= s.pll_lock_ns)
+    {
+      s.registers[ADDRESS_PLLCSR] |= 0x01;
+      s.pll_lock_ns = 0;
+    }
+    // RCON and EXTON are set once the oscillators started (RC 6 CK, crystal 16K CK)
+    if (address == ADDRESS_CLKSTA)
+    {
+      if (s.rc_on_ns && s.time_ns >= s.rc_on_ns) { s.registers[ADDRESS_CLKSTA] |= 0x02; s.rc_on_ns = 0; }
+      if (s.ext_on_ns && s.time_ns >= s.ext_on_ns) { s.registers[ADDRESS_CLKSTA] |= 0x01; s.ext_on_ns = 0; }
+    }
+    value = s.registers[address];
+    s.reads++;
+    if (s.wdce_window) s.wdce_window--;
+    if (s.clkpce_window) s.clkpce_window--;
+    record(address, REGISTER_READ, value);
+    cycles(1);
+    return value;
+  }
+
+  inline void write(uint8_t address, uint8_t value)
+  {
+    State& s = state();
+    uint8_t& reg = s.registers[address];
+    uint8_t  wdce_window = s.wdce_window;
+    uint8_t  clkpce_window = s.clkpce_window;
+    s.writes++;
+    s.wdce_window = wdce_window ? wdce_window - 1 : 0;
+    s.clkpce_window = clkpce_window ? clkpce_window - 1 : 0;
+    record(address, REGISTER_WRITE, value);
+    switch (address)
+    {
+      case ADDRESS_WDTCSR:
+      {
+        // WDIF is cleared by writing one, WDE and WDP3:0 are protected by the WDCE timed sequence
+        uint8_t flags = (reg & ~value) & (1 << 7);
+        uint8_t protect = (1 << 5) | (1 << 3) | 0x07;
+        if ((value & (1 << 4)) && (value & (1 << 3)))
+        {
+          s.wdce_window = 4;
+          reg = flags | (reg & protect) | (value & (1 << 6)) | (1 << 4) | (1 << 3);
+        }
+        else if (wdce_window)
+        {
+          reg = flags | (value & ((1 << 6) | protect));
+        }
+        else
+        {
+          // WDE can be set freely, clearing it or changing the prescaler needs the timed sequence
+          if (((value ^ reg) & (protect & ~(1 << 3))) || ((reg & ~value) & (1 << 3))) s.timed_sequence_errors++;
+          reg = flags | (reg & protect) | (value & ((1 << 6) | (1 << 3)));
+        }
+        if (s.registers[ADDRESS_MCUSR] & (1 << 3)) reg |= (1 << 3);
+        watchdog_restart();
+        break;
+      }
+      case ADDRESS_CLKPR:
+        // CLKPCE must be written alone, the prescaler must follow within four cycles
+        if (value & 0x80)
+        {
+          if (value & 0x0F) s.timed_sequence_errors++;
+          s.clkpce_window = 4;
+        }
+        else if (clkpce_window)
+        {
+          reg = value & 0x0F;
+        }
+        else
+        {
+          s.timed_sequence_errors++;
+        }
+        break;
+      case ADDRESS_MCUSR:
+        reg = reg & value;
+        break;
+      case ADDRESS_CLKSEL0:
+        if ((value & 0x08) && !(reg & 0x08)) s.rc_on_ns = s.time_ns + 750ULL;
+        if ((value & 0x04) && !(reg & 0x04)) s.ext_on_ns = s.time_ns + 1024000ULL;
+        if (!(value & 0x08)) { s.registers[ADDRESS_CLKSTA] &= ~0x02; s.rc_on_ns = 0; }
+        if (!(value & 0x04)) { s.registers[ADDRESS_CLKSTA] &= ~0x01; s.ext_on_ns = 0; }
+        // Switching CLKS to an oscillator not running yet is a programming error
+        if ((value & 0x01) ? !(s.registers[ADDRESS_CLKSTA] & 0x01) : !(s.registers[ADDRESS_CLKSTA] & 0x02)) s.timed_sequence_errors++;
+        reg = value;
+        break;
+      case ADDRESS_PLLCSR:
+        if ((value & 0x02) && !(reg & 0x02)) s.pll_lock_ns = s.time_ns + 100000ULL;
+        if (!(value & 0x02)) s.pll_lock_ns = 0;
+        reg = (value & 0x12) | ((value & 0x02) ? (reg & 0x01) : 0);
+        break;
+      case ADDRESS_UDINT:
+        // Interrupt flags are only cleared with the USB clock running (FRZCLK clear)
+        if (!(s.registers[ADDRESS_USBCON] & 0x20)) reg = value;
+        break;
+      case ADDRESS_TCCR1B:
+      case ADDRESS_TCCR3B:
+        reg = value;
+        timer16_start(address == ADDRESS_TCCR3B);
+        break;
+      case ADDRESS_TIFR0:
+      case ADDRESS_TIFR1:
+      case ADDRESS_TIFR3:
+      case ADDRESS_PCIFR:
+      case ADDRESS_EIFR:
+        reg = reg & ~value;
+        break;
+      default:
+        reg = value;
+        break;
+    }
+    cycles(1);
+  }
+
+  // Next wake up event of the current sleep mode, 0 when nothing can wake the MCU
+  inline uint64_t next_wake_ns()
+  {
+    State& s = state();
+    uint64_t wake = 0;
+    if (s.wdt_deadline_ns && (s.registers[ADDRESS_WDTCSR] & (1 << 6))) wake = s.wdt_deadline_ns;
+    if (s.event.handler && (!wake || s.event.time_ns < wake)) wake = s.event.time_ns;
+    if (s.adc_deadline_ns && (s.registers[ADDRESS_ADCSRA] & (1 << 3)) && (!wake || s.adc_deadline_ns < wake)) wake = s.adc_deadline_ns;
+    if (s.compb_deadline_ns[0] && (s.registers[ADDRESS_TIMSK1] & (1 << 2)) && (!wake || s.compb_deadline_ns[0] < wake)) wake = s.compb_deadline_ns[0];
+    if (s.compb_deadline_ns[1] && (s.registers[ADDRESS_TIMSK3] & (1 << 2)) && (!wake || s.compb_deadline_ns[1] < wake)) wake = s.compb_deadline_ns[1];
+    if (timer0_running() && (s.registers[ADDRESS_TIMSK0] & 0x01))
+    {
+      uint64_t overflow = s.time_ns + timer0_overflow_ns() - s.timer0_fraction_ns;
+      if (!wake || overflow < wake) wake = overflow;
+    }
+    return wake;
+  }
+
+  inline void sleep()
+  {
+    State& s = state();
+    uint64_t wake;
+    s.sleeps++;
+    record(ADDRESS_SMCR, SLEEP_CPU, s.registers[ADDRESS_SMCR]);
+    if (!(s.registers[ADDRESS_SMCR] & 0x01) || !interrupts_enabled()) return;
+    s.sleeping = 1;
+    if ((s.registers[ADDRESS_SMCR] & 0x0E) == 0x02) adc_start();
+    wake = next_wake_ns();
+    if (wake > s.time_ns) advance(wake - s.time_ns);
+    s.sleeping = 0;
+  }
+
+  // Schedules an external wake up event (an interrupt handler run at time_ns)
+  inline void schedule_event(uint64_t delay_ns, void (*handler)())
+  {
+    state().event.time_ns = state().time_ns + delay_ns;
+    state().event.handler = handler;
+  }
+
+  // External interrupt number 0-4 (INT0-3, INT6) triggered by its pin, run when enabled in EIMSK
+  inline void trigger_interrupt(uint8_t number)
+  {
+    State& s = state();
+    static const uint8_t bits[] = { 0x01, 0x02, 0x04, 0x08, 0x40 };
+    s.registers[ADDRESS_EIFR] |= bits[number];
+    if (!(s.registers[ADDRESS_EIMSK] & bits[number]) || !interrupts_enabled() || !s.int_handlers[number]) return;
+    s.registers[ADDRESS_EIFR] &= ~bits[number];
+    s.int_handlers[number]();
+  }
+
+  // Pin change of PCINT0-7, run when the pin is enabled in PCMSK0 and the interrupt in PCICR
+  inline void trigger_pin_change(uint8_t pin)
+  {
+    State& s = state();
+    if (!(s.registers[ADDRESS_PCMSK0] & (1 << pin))) return;
+    s.registers[ADDRESS_PCIFR] |= 0x01;
+    if (!(s.registers[ADDRESS_PCICR] & 0x01) || !interrupts_enabled()) return;
+    s.registers[ADDRESS_PCIFR] &= ~0x01;
+    savepower_PCINT0_vect();
+  }
+
+  // USB_GEN_vect of the Arduino core (USBCore.cpp) : suspend enables WAKEUPE in place of SUSPE, wake up does the opposite
+  inline void usb_suspend()
+  {
+    State& s = state();
+    s.registers[ADDRESS_UDINT] |= 0x01;
+    s.registers[ADDRESS_UDIEN] = (s.registers[ADDRESS_UDIEN] & ~0x01) | 0x10;
+    if (!(s.registers[ADDRESS_USBCON] & 0x20)) s.registers[ADDRESS_UDINT] &= ~0x11;
+  }
+
+  inline void usb_resume()
+  {
+    State& s = state();
+    s.registers[ADDRESS_UDINT] |= 0x10;
+    if (!(s.registers[ADDRESS_UDIEN] & 0x10)) return;
+    s.registers[ADDRESS_UDIEN] = (s.registers[ADDRESS_UDIEN] & ~0x10) | 0x01;
+    if (!(s.registers[ADDRESS_USBCON] & 0x20)) s.registers[ADDRESS_UDINT] &= ~0x10;
+  }
+
+  // Power on reset of the emulated MCU, as left by the Arduino bootloader and core init()
+  inline void reset()
+  {
+    State& s = state();
+    memset(&s, 0, sizeof(s));
+    s.wdt_scale = 1.0;
+    s.registers[ADDRESS_TCCR0B] = 0x03;
+    s.registers[ADDRESS_TIMSK0] = 0x01;
+    s.registers[ADDRESS_ADCSRA] = 0x87;
+    s.registers[ADDRESS_SREG] = 0x80;
+    s.registers[ADDRESS_UCSR1A] = 0x20;
+    s.registers[ADDRESS_CLKSEL0] = 0x05;
+    s.registers[ADDRESS_CLKSTA] = 0x01;
+    s.registers[ADDRESS_USBCON] = 0x90;
+    s.registers[ADDRESS_PLLCSR] = 0x13;
+    s.registers[ADDRESS_UDIEN] = 0x01;
+    s.registers[ADDRESS_TCCR1A] = 0x01;
+    s.registers[ADDRESS_TCCR1B] = 0x03;
+    s.registers[ADDRESS_TCCR3A] = 0x01;
+    s.registers[ADDRESS_TCCR3B] = 0x03;
+    timer0_millis = 0;
+    timer0_overflow_count = 0;
+  }
+
+  // Number of logged accesses of one type to one register
+  inline uint16_t count(uint8_t address, uint8_t type)
+  {
+    State& s = state();
+    uint16_t total = 0;
+    for (uint16_t index = 0; index < s.log_count; index++)
+    {
+      if (s.log[index].address == address && s.log[index].type == type) total++;
+    }
+    return total;
+  }
+
+  inline void clear_log()
+  {
+    State& s = state();
+    s.log_count = 0;
+    s.reads = 0;
+    s.writes = 0;
+    s.sleeps = 0;
+  }
+}
+
+// Special Function Registers
+#define _SFR_MEM8(address) (SavePowerEmulation::Register(address))
+#define TIFR0       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_TIFR0)
+#define PCIFR       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_PCIFR)
+#define EIFR        SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_EIFR)
+#define EIMSK       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_EIMSK)
+#define TIFR1       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_TIFR1)
+#define TIFR3       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_TIFR3)
+#define TIMSK1      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_TIMSK1)
+#define TIMSK3      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_TIMSK3)
+#define TCCR1A      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_TCCR1A)
+#define TCCR1B      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_TCCR1B)
+#define TCNT1       SavePowerEmulation::Register16(SavePowerEmulation::ADDRESS_TCNT1L)
+#define OCR1B       SavePowerEmulation::Register16(SavePowerEmulation::ADDRESS_OCR1BL)
+#define TCCR3A      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_TCCR3A)
+#define TCCR3B      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_TCCR3B)
+#define TCNT3       SavePowerEmulation::Register16(SavePowerEmulation::ADDRESS_TCNT3L)
+#define OCR3B       SavePowerEmulation::Register16(SavePowerEmulation::ADDRESS_OCR3BL)
+#define PCICR       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_PCICR)
+#define PCMSK0      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_PCMSK0)
+#define TCCR0B      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_TCCR0B)
+#define TCNT0       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_TCNT0)
+#define ACSR        SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_ACSR)
+#define SMCR        SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_SMCR)
+#define MCUSR       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_MCUSR)
+#define SREG        SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_SREG)
+#define WDTCSR      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_WDTCSR)
+#define CLKPR       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_CLKPR)
+#define PRR0        SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_PRR0)
+#define PRR1        SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_PRR1)
+#define TIMSK0      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_TIMSK0)
+#define ADCSRA      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_ADCSRA)
+#define ADCSRB      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_ADCSRB)
+#define ADMUX       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_ADMUX)
+#define ADC         SavePowerEmulation::Register16(SavePowerEmulation::ADDRESS_ADCL)
+#define DDRB        SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_DDRB)
+#define PORTB       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_PORTB)
+#define DDRC        SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_DDRC)
+#define PORTC       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_PORTC)
+#define DDRD        SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_DDRD)
+#define PORTD       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_PORTD)
+#define DDRE        SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_DDRE)
+#define PORTE       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_PORTE)
+#define DDRF        SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_DDRF)
+#define PORTF       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_PORTF)
+#define DIDR0       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_DIDR0)
+#define DIDR1       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_DIDR1)
+#define DIDR2       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_DIDR2)
+#define UCSR1A      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_UCSR1A)
+#define UCSR1B      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_UCSR1B)
+#define UBRR1       SavePowerEmulation::Register16(SavePowerEmulation::ADDRESS_UBRR1L)
+#define CLKSEL0     SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_CLKSEL0)
+#define CLKSEL1     SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_CLKSEL1)
+#define CLKSTA      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_CLKSTA)
+#define PLLFRQ      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_PLLFRQ)
+#define PLLCSR      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_PLLCSR)
+#define USBCON      SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_USBCON)
+#define UDINT       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_UDINT)
+#define UDIEN       SavePowerEmulation::Register(SavePowerEmulation::ADDRESS_UDIEN)
+
+// Register bits
+#define TOV0     0
+#define TOIE0    0
+#define ACD      7
+#define ACI      4
+#define SE       0
+#define SM0      1
+#define SM1      2
+#define SM2      3
+#define WDRF     3
+#define WDIF     7
+#define WDIE     6
+#define WDP3     5
+#define WDCE     4
+#define WDE      3
+#define WDP2     2
+#define WDP1     1
+#define WDP0     0
+#define CLKPCE   7
+#define PRTWI    7
+#define PRTIM0   5
+#define PRTIM1   3
+#define PRSPI    2
+#define PRADC    0
+#define PRUSB    7
+#define PRTIM4   4
+#define PRTIM3   3
+#define PRUSART1 0
+#define ADEN     7
+#define ADSC     6
+#define ADIF     4
+#define ADIE     3
+#define MUX5     5
+#define AIN0D    0
+#define OCIE1B   2
+#define OCF1B    2
+#define OCIE3B   2
+#define OCF3B    2
+#define REFS0    6
+#define TXC1     6
+#define UDRE1    5
+#define U2X1     1
+#define RXEN1    4
+#define TXEN1    3
+#define RXCIE1   7
+#define INT0     0
+#define INT1     1
+#define INT2     2
+#define INT3     3
+#define INT6     6
+#define PCIE0    0
+#define PCIF0    0
+#define SUSPE    0
+#define WAKEUPE  4
+#define SUSPI    0
+#define WAKEUPI  4
+#define USBE     7
+#define FRZCLK   5
+#define PLLE     1
+#define PLOCK    0
+#define PINMUX   7
+#define CLKS     0
+#define EXTE     2
+#define RCE      3
+#define EXTON    0
+#define RCON     1
+
+#define _BV(bit) (1 << (bit))
+
+// avr/interrupt.h, like avr/sleep.h and avr/wdt.h below the calls are function-like macros there, a sketch may test them with #ifdef
+inline void savepower_cli() { SavePowerEmulation::state().registers[SavePowerEmulation::ADDRESS_SREG] &= ~0x80; }
+inline void savepower_sei() { SavePowerEmulation::state().registers[SavePowerEmulation::ADDRESS_SREG] |= 0x80; }
+
+#define cli()  savepower_cli()
+#define sei()  savepower_sei()
+
+// avr/sleep.h
+#define SLEEP_MODE_IDLE         0x00
+#define SLEEP_MODE_ADC          0x02
+#define SLEEP_MODE_PWR_DOWN     0x04
+#define SLEEP_MODE_PWR_SAVE     0x06
+#define SLEEP_MODE_STANDBY      0x0C
+#define SLEEP_MODE_EXT_STANDBY  0x0E
+
+#define set_sleep_mode(mode)  (SMCR = (SMCR & ~((1 << SM0) | (1 << SM1) | (1 << SM2))) | (mode))
+#define sleep_enable()        (SMCR |= (1 << SE))
+#define sleep_disable()       (SMCR &= ~(1 << SE))
+#define sleep_cpu()           SavePowerEmulation::sleep()
+#define sleep_mode()          do { sleep_enable(); sleep_cpu(); sleep_disable(); } while (0)
+
+// avr/wdt.h, the time-outs are macros there too
+#define WDTO_15MS   0
+#define WDTO_30MS   1
+#define WDTO_60MS   2
+#define WDTO_120MS  3
+#define WDTO_250MS  4
+#define WDTO_500MS  5
+#define WDTO_1S     6
+#define WDTO_2S     7
+#define WDTO_4S     8
+#define WDTO_8S     9
+
+inline void savepower_wdt_reset() { SavePowerEmulation::watchdog_restart(); SavePowerEmulation::cycles(1); }
+
+#define wdt_reset()  savepower_wdt_reset()
+
+inline void savepower_wdt_enable(uint8_t value)
+{
+  uint8_t sreg = SREG;
+  cli();
+  wdt_reset();
+  WDTCSR = (1 << WDCE) | (1 << WDE);
+  WDTCSR = (1 << WDE) | (value & 0x07) | ((value & 0x08) ? (1 << WDP3) : 0);
+  SREG = sreg;
+}
+
+inline void savepower_wdt_disable()
+{
+  uint8_t sreg = SREG;
+  cli();
+  wdt_reset();
+  WDTCSR = (1 << WDCE) | (1 << WDE);
+  WDTCSR = 0x00;
+  SREG = sreg;
+}
+
+#define wdt_enable(value)  savepower_wdt_enable(value)
+#define wdt_disable()      savepower_wdt_disable()
+
+// Arduino.h
+inline unsigned long millis()
+{
+  SavePowerEmulation::cycles(40);
+  return timer0_millis;
+}
+
+inline unsigned long micros()
+{
+  SavePowerEmulation::cycles(60);
+  return ((timer0_overflow_count << 8) + SavePowerEmulation::state().registers[SavePowerEmulation::ADDRESS_TCNT0])
+         * (64 / (F_CPU / 1000000UL));
+}
+
+inline void delay(unsigned long ms)
+{
+  unsigned long start = micros();
+  while (micros() - start < ms * 1000UL) {}
+}
+
+// avr/eeprom.h : 1KB kept across reset() (a new power up of the emulated MCU), every byte changed costs the 3.4ms of an erase and write.
+// Defining E2END as 0x1FF emulates the 512 bytes of an ATMega16u4
+#ifndef E2END
+ #define E2END 0x3FF
+#endif
+
+namespace SavePowerEmulation
+{
+  struct Eeprom
+  {
+    uint8_t  bytes[E2END + 1];
+    uint32_t writes;
+  };
+
+  inline Eeprom& eeprom() 
+  { 
+    static Eeprom e = { { 0 }, 0 }; 
+    static bool erased = false;
+    if (!erased)
+    {
+      memset(e.bytes, 0xFF, sizeof(e.bytes));
+      erased = true;
+    }
+    return e; 
+  }
+}
+
+inline uint8_t eeprom_read_byte(const uint8_t *address)
+{
+  SavePowerEmulation::cycles(4);
+  return SavePowerEmulation::eeprom().bytes[(uintptr_t)address & E2END];
+}
+
+inline void eeprom_update_byte(uint8_t *address, uint8_t value)
+{
+  SavePowerEmulation::Eeprom& e = SavePowerEmulation::eeprom();
+  SavePowerEmulation::cycles(4);
+  if (e.bytes[(uintptr_t)address & E2END] == value) return;
+  e.bytes[(uintptr_t)address & E2END] = value;
+  e.writes++;
+  SavePowerEmulation::advance(3400000ULL);
+}
+
+inline void eeprom_read_block(void *destination, const void *source, size_t size)
+{
+  for (size_t i = 0; i < size; i++) ((uint8_t *)destination)[i] = eeprom_read_byte((const uint8_t *)source + i);
+}
+
+inline void eeprom_update_block(const void *source, void *destination, size_t size)
+{
+  for (size_t i = 0; i < size; i++) eeprom_update_byte((uint8_t *)destination + i, ((const uint8_t *)source)[i]);
+}
+
+// Print.h and Stream.h, reduced to what the library and the host programs use
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t value) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+      size_t n = 0;
+      while (size--) n += write(*buffer++);
+      return n;
+    }
+    size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+    size_t print(const char *str) { return write(str); }
+    size_t print(unsigned long value)
+    {
+      char digits[11];
+      uint8_t n = sizeof(digits);
+      do
+      {
+        digits[--n] = '0' + value % 10;
+        value /= 10;
+      } while (value);
+      return write((const uint8_t *)digits + n, sizeof(digits) - n);
+    }
+    size_t println(const char *str) { return write(str) + write("\r\n"); }
+    size_t println(unsigned long value) { return print(value) + write("\r\n"); }
+    virtual void flush() {}
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+// Interrupt modes and Leonardo pin mapping (pin 3, 2, 0, 1, 7 are INT0, INT1, INT2, INT3, INT6)
+#define LOW     0
+#define CHANGE  1
+#define FALLING 2
+#define RISING  3
+
+inline int digitalPinToInterrupt(uint8_t pin)
+{
+  return pin == 3 ? 0 : pin == 2 ? 1 : pin == 0 ? 2 : pin == 1 ? 3 : pin == 7 ? 4 : -1;
+}
+
+// As WInterrupts.c : EICRA/EICRB are not emulated, only the handler and the EIMSK bit
+inline void attachInterrupt(uint8_t number, void (*handler)(), int mode)
+{
+  static const uint8_t bits[] = { 0x01, 0x02, 0x04, 0x08, 0x40 };
+  (void)mode;
+  if (number > 4) return;
+  SavePowerEmulation::state().int_handlers[number] = handler;
+  EIMSK |= bits[number];
+}
+
+inline void detachInterrupt(uint8_t number)
+{
+  static const uint8_t bits[] = { 0x01, 0x02, 0x04, 0x08, 0x40 };
+  if (number > 4) return;
+  EIMSK &= ~bits[number];
+  SavePowerEmulation::state().int_handlers[number] = 0;
+}
+
+// Leonardo variant (pins_arduino.h) : port and bit of the digital pins 0 to 30
+#define NOT_A_PIN 0
+#define PB 2
+#define PC 3
+#define PD 4
+#define PE 5
+#define PF 6
+
+inline uint8_t digitalPinToPort(uint8_t pin)
+{
+  static const uint8_t port[] = { PD, PD, PD, PD, PD, PC, PD, PE, PB, PB, PB, PB, PD, PC, PB, PB, PB, PB, PF, PF, PF, PF, PF, PF, PD, PD, PB, PB, 
+                                  PB, PD, PD };
+  return pin < sizeof(port) ? port[pin] : NOT_A_PIN;
+}
+
+inline uint8_t digitalPinToBitMask(uint8_t pin)
+{
+  static const uint8_t bit[] = { 2, 3, 1, 0, 4, 6, 7, 6, 4, 5, 6, 7, 6, 7, 3, 1, 2, 0, 7, 6, 5, 4, 1, 0, 4, 7, 4, 5, 6, 6, 5 };
+  return pin < sizeof(bit) ? (1 << bit[pin]) : 0;
+}
+
+// Counted in CPU cycles, as the avr-libc busy loops
+inline void delayMicroseconds(unsigned int us)
+{
+  SavePowerEmulation::cycles((uint32_t)us * (F_CPU / 1000000UL));
+}
+
+#endif
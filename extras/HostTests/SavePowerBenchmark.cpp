@@ -0,0 +1,87 @@
+/****************************************************************************************
+* ATMega32U4/16U4 SavePower Library - Host Benchmark
+* Host program (Linux) counting the register accesses and the time of each method on the emulation of SavePowerEmulation.h
+*****************************************************************************************/
+
+/***********************************************************************************************************************************************
+For each method on the sleep and wake up paths, one line with the register reads and writes, the sleep_cpu() calls, the timed sequence errors
+and the emulated time it took, measured from a power up of the emulated MCU and of the library. The register accesses stand for the flash
+and the cycles the method costs on the silicon, a change to the library shows here before any board is flashed.
+
+Build and run from this folder :
+
+  g++ -std=c++17 -DSAVEPOWER_HOST_EMULATION -I../.. -o SavePowerBenchmark SavePowerBenchmark.cpp ../../SavePower.cpp
+  ./SavePowerBenchmark
+***********************************************************************************************************************************************/
+
+#include "SavePower.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace SavePowerEmulation;
+
+static void PowerDownMode() { SavePower.PowerDownMode(WDTO_1S); }
+static void SleepPowerDown() { SavePower.Sleep<MODE_POWER_DOWN, WDTO_1S>(); }
+static void IdleMode() { SavePower.IdleMode(WDTO_15MS); }
+static void SleepIdle() { SavePower.Sleep<MODE_IDLE, WDTO_15MS>(); }
+static void LowestConsumption() { SavePower.LowestConsumption(WDTO_15MS); }
+static void SleepFor10s() { SavePower.SleepFor(10000); }
+static void SleepUntil10s() { SavePower.SleepUntil(10000); }
+static void SleepMicros500us() { SavePower.SleepMicros(500); }
+static void SleepMicros10s() { SavePower.SleepMicros(10000000UL); }
+static void DisableAllModules() { SavePower.DisableAllModules(); }
+static void DisableTemplate() { SavePower.Disable<DOMAIN_SPI, DOMAIN_TWI, DOMAIN_TIMER4>(); }
+static void EnableTemplate() { SavePower.Enable<DOMAIN_SPI, DOMAIN_TWI, DOMAIN_TIMER4>(); }
+static void CommitDomains() { SavePower.AcquireDomain(DOMAIN_SPI); SavePower.CommitDomains(); }
+static void ScaleClockSpeed() { SavePower.ScaleClockSpeed(4); }
+static void Now() { SavePower.Now(); }
+static void CalibrateWatchdog() { SavePower.CalibrateWatchdog(); }
+
+static const struct { const char *name; void (*run)(); } benchmarks[] =
+{
+  { "PowerDownMode(WDTO_1S)", PowerDownMode },
+  { "Sleep<MODE_POWER_DOWN, WDTO_1S>()", SleepPowerDown },
+  { "IdleMode(WDTO_15MS)", IdleMode },
+  { "Sleep<MODE_IDLE, WDTO_15MS>()", SleepIdle },
+  { "LowestConsumption(WDTO_15MS)", LowestConsumption },
+  { "SleepFor(10000)", SleepFor10s },
+  { "SleepUntil(10000)", SleepUntil10s },
+  { "SleepMicros(500)", SleepMicros500us },
+  { "SleepMicros(10000000)", SleepMicros10s },
+  { "DisableAllModules()", DisableAllModules },
+  { "Disable<SPI, TWI, TIMER4>()", DisableTemplate },
+  { "Enable<SPI, TWI, TIMER4>()", EnableTemplate },
+  { "CommitDomains()", CommitDomains },
+  { "ScaleClockSpeed(4)", ScaleClockSpeed },
+  { "Now()", Now },
+  { "CalibrateWatchdog()", CalibrateWatchdog },
+};
+
+// Measuring a method in a child process, on a freshly powered up MCU and library
+static void Measure(const char *name, void (*run)())
+{
+  pid_t child;
+  fflush(stdout);
+  child = fork();
+  if (child == 0)
+  {
+    uint64_t start_ns;
+    reset();
+    clear_log();
+    start_ns = state().time_ns;
+    run();
+    printf("%-36s %6u %6u %6u %4u %14.3f\n", name, (unsigned)state().reads, (unsigned)state().writes, (unsigned)state().sleeps,
+           (unsigned)state().timed_sequence_errors, (state().time_ns - start_ns) / 1e6);
+    fflush(stdout);
+    _exit(0);
+  }
+  waitpid(child, 0, 0);
+}
+
+int main()
+{
+  printf("%-36s %6s %6s %6s %4s %14s\n", "method", "reads", "writes", "sleeps", "tse", "time (ms)");
+  for (const auto& benchmark : benchmarks) Measure(benchmark.name, benchmark.run);
+  return 0;
+}
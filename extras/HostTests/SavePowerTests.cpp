@@ -0,0 +1,774 @@
+/****************************************************************************************
+* ATMega32U4/16U4 SavePower Library - Host Tests
+* Host program (Linux) checking the library against the register emulation of SavePowerEmulation.h
+*****************************************************************************************/
+
+/***********************************************************************************************************************************************
+Every test runs the library on the emulated ATMega32u4 and checks what the silicon would see : the exact values written to WDTCSR, CLKPR,
+SMCR, PRR0 and PRR1 by each method, the timed sequences (timed_sequence_errors stays 0 and the Watchdog never resets the MCU), and the time
+kept by millis() and Now() against the emulated time across every kind of sleep. Each test runs in its own process, so it starts from a
+power up of both the emulated MCU and the library.
+
+Build and run from this folder :
+
+  g++ -std=c++17 -DSAVEPOWER_HOST_EMULATION -I../.. -o SavePowerTests SavePowerTests.cpp ../../SavePower.cpp
+  ./SavePowerTests [test name ...]
+
+With no argument every test runs. The exit status is the number of failed tests.
+***********************************************************************************************************************************************/
+
+#include "SavePower.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+using namespace SavePowerEmulation;
+
+static int failures;
+
+// Reporting a failed check with its line, the test goes on to report every failure
+static void Check(bool passed, const char *condition, int line)
+{
+  if (passed) return;
+  printf("  line %d : %s\n", line, condition);
+  failures++;
+}
+
+#define CHECK(condition) Check((condition), #condition, __LINE__)
+
+// Values written to a register since the last clear_log()
+static std::vector<uint8_t> Writes(uint8_t address)
+{
+  std::vector<uint8_t> values;
+  for (uint16_t index = 0; index < state().log_count; index++)
+  {
+    if (state().log[index].address == address && state().log[index].type == REGISTER_WRITE) values.push_back(state().log[index].value);
+  }
+  return values;
+}
+
+static bool WritesAre(uint8_t address, std::initializer_list<uint8_t> expected)
+{
+  return Writes(address) == std::vector<uint8_t>(expected);
+}
+
+// True when no value written to a register since the last clear_log() has any of the bits set
+static bool NeverSet(uint8_t address, uint8_t bits)
+{
+  for (uint8_t value : Writes(address)) if (value & bits) return false;
+  return true;
+}
+
+static bool Near(double value, double expected, double tolerance)
+{
+  return value >= expected - tolerance && value <= expected + tolerance;
+}
+
+static double ElapsedMs(uint64_t since_ns)
+{
+  return (state().time_ns - since_ns) / 1e6;
+}
+
+static void TriggerINT0() { trigger_interrupt(0); }
+static void TriggerINT1() { trigger_interrupt(1); }
+
+static int callbacks;
+static void Callback() { callbacks++; }
+
+// CLKPCE written alone, then the prescaler within four cycles
+static void TestClockPrescalerSequence()
+{
+  clear_log();
+  SavePower.ScaleClockSpeed(4);
+  CHECK(WritesAre(ADDRESS_CLKPR, { 0x80, 0x02 }));
+  CHECK(state().registers[ADDRESS_CLKPR] == 0x02);
+  clear_log();
+  SavePower.DivideClockSpeed(8);
+  CHECK(WritesAre(ADDRESS_CLKPR, { 0x80, 0x03 }));
+  clear_log();
+  SavePower.ScaleClockSpeed(1);
+  CHECK(WritesAre(ADDRESS_CLKPR, { 0x80, 0x00 }));
+  CHECK(state().registers[ADDRESS_CLKPR] == 0x00);
+  CHECK(state().timed_sequence_errors == 0);
+}
+
+// WDRF cleared, WDCE with WDE, then interrupt mode with the prescaler : the Watchdog never runs in reset mode
+static void TestWatchdogSequence()
+{
+  clear_log();
+  SavePower.PowerDownMode(WDTO_1S);
+  CHECK(WritesAre(ADDRESS_MCUSR, { 0x00, 0x00 }));
+  CHECK(WritesAre(ADDRESS_WDTCSR, { 0x18, 0x46, 0x18, 0x00 }));
+  clear_log();
+  SavePower.PowerDownMode(WDTO_8S);
+  CHECK(WritesAre(ADDRESS_WDTCSR, { 0x18, 0x61, 0x18, 0x00 }));
+  // Staying awake long past a time-out must not reset the MCU
+  SavePower.PowerDownMode(WDTO_15MS);
+  delay(3000);
+  CHECK(state().registers[ADDRESS_WDTCSR] == 0x00);
+  CHECK(state().resets == 0);
+  CHECK(state().timed_sequence_errors == 0);
+}
+
+// Each sleep method writes its mode bits, sets SE for sleep_cpu() and clears it on wake up
+static void TestSleepModeSequences()
+{
+  static const struct { void (SavePowerClass::*method)(Time_Out_Value); uint8_t bits; } modes[] =
+  {
+    { &SavePowerClass::IdleMode, 0x00 }, { &SavePowerClass::ADCNoiseReductionMode, 0x02 }, { &SavePowerClass::PowerDownMode, 0x04 },
+    { &SavePowerClass::PowerSaveMode, 0x06 }, { &SavePowerClass::StandbyMode, 0x0C }, { &SavePowerClass::ExtendedStandbyMode, 0x0E }
+  };
+  for (const auto& mode : modes)
+  {
+    clear_log();
+    (SavePower.*mode.method)(WDTO_15MS);
+    CHECK(WritesAre(ADDRESS_SMCR, { mode.bits, (uint8_t)(mode.bits | 0x01), mode.bits }));
+    CHECK(state().sleeps == 1);
+  }
+  // The avr/sleep.h macros of a sketch sleeping by itself, Idle ends with the next Timer0 tick
+  clear_log();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_mode();
+  CHECK(WritesAre(ADDRESS_SMCR, { 0x00, 0x01, 0x00 }));
+  CHECK(state().sleeps == 1);
+  CHECK(state().timed_sequence_errors == 0);
+}
+
+// One PRR write per register for any set of domains, none for a register the set does not touch
+static void TestPowerReductionSequences()
+{
+  clear_log();
+  SavePower.DisableAllModules();
+  CHECK(WritesAre(ADDRESS_PRR0, { 0xAD }));
+  CHECK(WritesAre(ADDRESS_PRR1, { 0x99 }));
+  clear_log();
+  SavePower.EnableAllModules();
+  CHECK(WritesAre(ADDRESS_PRR0, { 0x00 }));
+  CHECK(WritesAre(ADDRESS_PRR1, { 0x00 }));
+  clear_log();
+  SavePower.Disable<DOMAIN_SPI, DOMAIN_TWI, DOMAIN_TIMER4>();
+  CHECK(WritesAre(ADDRESS_PRR0, { 0x84 }));
+  CHECK(WritesAre(ADDRESS_PRR1, { 0x10 }));
+  clear_log();
+  SavePower.Enable<DOMAIN_SPI, DOMAIN_TWI, DOMAIN_TIMER4>();
+  CHECK(WritesAre(ADDRESS_PRR0, { 0x00 }));
+  CHECK(WritesAre(ADDRESS_PRR1, { 0x00 }));
+  // The ADC is turned off before its clock is stopped
+  clear_log();
+  SavePower.DisableADC();
+  CHECK(WritesAre(ADDRESS_PRR0, { 0x01 }));
+  CHECK(Writes(ADDRESS_PRR1).empty());
+  CHECK(!(state().registers[ADDRESS_ADCSRA] & 0x80));
+  clear_log();
+  SavePower.DisableUSART();
+  CHECK(Writes(ADDRESS_PRR0).empty());
+  CHECK(WritesAre(ADDRESS_PRR1, { 0x01 }));
+}
+
+// Sleep<>() keeps the register sequence of PowerDownMode() with fewer accesses, and the same time added to millis()
+static void TestSleepTemplate()
+{
+  uint32_t start;
+  uint32_t method_reads;
+  uint32_t method_writes;
+  clear_log();
+  start = millis();
+  SavePower.PowerDownMode(WDTO_1S);
+  CHECK(millis() - start == 1024);
+  method_reads = state().reads;
+  method_writes = state().writes;
+  clear_log();
+  start = millis();
+  SavePower.Sleep<MODE_POWER_DOWN, WDTO_1S>();
+  CHECK(millis() - start == 1024);
+  CHECK(WritesAre(ADDRESS_WDTCSR, { 0x18, 0x46, 0x18, 0x00 }));
+  CHECK(state().sleeps == 1);
+  CHECK(state().reads < method_reads);
+  CHECK(state().writes < method_writes);
+  CHECK(state().timed_sequence_errors == 0);
+}
+
+// SleepFor() chains the Watchdog periods and adds them to millis()
+static void TestSleepForTimekeeping()
+{
+  uint64_t start_ns = state().time_ns;
+  uint32_t start = SavePower.Now();
+  clear_log();
+  SavePower.SleepFor(10000);
+  CHECK(Near(ElapsedMs(start_ns), 10000, 16));
+  CHECK(Near(SavePower.Now() - start, ElapsedMs(start_ns), 2));
+  CHECK(state().sleeps == 5);
+  CHECK(state().resets == 0);
+  CHECK(state().timed_sequence_errors == 0);
+  SavePowerStats stats = SavePower.GetPowerStats();
+  CHECK(Near(stats.residency_ms[MODE_POWER_DOWN], 10000, 16));
+  CHECK(stats.wakes[WAKE_WATCHDOG] == 5);
+}
+
+// A Watchdog running 10% slow is measured, and the long sleeps are corrected, also with a scaled clock
+static void TestWatchdogCalibration()
+{
+  uint64_t start_ns;
+  state().wdt_scale = 1.1;
+  CHECK(Near(SavePower.CalibrateWatchdog(), 1126, 2));
+  start_ns = state().time_ns;
+  SavePower.SleepFor(60000);
+  CHECK(Near(ElapsedMs(start_ns), 60000, 60));
+  state().wdt_scale = 1.0;
+  SavePower.ScaleClockSpeed(2);
+  CHECK(Near(SavePower.CalibrateWatchdog(), 1024, 2));
+  start_ns = state().time_ns;
+  SavePower.SleepFor(60000);
+  CHECK(Near(ElapsedMs(start_ns), 60000, 60));
+  SavePower.ScaleClockSpeed(1);
+  CHECK(state().timed_sequence_errors == 0);
+}
+
+// An early wake up : the slept part of the period is only credited at the next sleep, millis() never jumps under the sketch
+static void TestInterruptedPeriod()
+{
+  uint64_t start_ns = state().time_ns;
+  uint64_t delay_ns;
+  uint32_t start = SavePower.Now();
+  SavePower.AttachWakeSource(WAKE_INT0, Callback, LOW);
+  schedule_event(3000000000ULL, TriggerINT0);
+  SavePower.SleepFor(8000);
+  CHECK(Near(ElapsedMs(start_ns), 3000, 1));
+  CHECK(SavePower.LastWakeCause() == (1 << WAKE_INT0));
+  delay_ns = state().time_ns;
+  SavePower.Delay(10000);
+  CHECK(Near(ElapsedMs(delay_ns), 10000, 2));
+  SavePower.SleepFor(1000);
+  CHECK(Near(SavePower.Now() - start, ElapsedMs(start_ns), 20));
+  // The end of the interrupted period wakes a sleep without time-out, its slept part is added once
+  SavePowerStats stats = SavePower.GetPowerStats();
+  start_ns = state().time_ns;
+  start = SavePower.Now();
+  schedule_event(1000000000ULL, TriggerINT0);
+  SavePower.SleepFor(8000);
+  SavePower.PowerDownMode(SLEEP_FOREVER);
+  CHECK(Near(ElapsedMs(start_ns), 4096, 20));
+  CHECK(Near(SavePower.Now() - start, ElapsedMs(start_ns), 20));
+  CHECK(Near(SavePower.GetPowerStats().residency_ms[MODE_POWER_DOWN] - stats.residency_ms[MODE_POWER_DOWN], 4096, 20));
+  start_ns = state().time_ns;
+  start = SavePower.Now();
+  schedule_event(1000000000ULL, TriggerINT0);
+  SavePower.SleepFor(8000);
+  SavePower.Sleep<MODE_POWER_DOWN>();
+  CHECK(Near(ElapsedMs(start_ns), 4096, 20));
+  CHECK(Near(SavePower.Now() - start, ElapsedMs(start_ns), 20));
+  // Re-armed before its end, half of what is left of the period is added
+  start_ns = state().time_ns;
+  start = SavePower.Now();
+  schedule_event(1000000000ULL, TriggerINT0);
+  SavePower.SleepFor(8000);
+  SavePower.Sleep<MODE_POWER_DOWN, WDTO_1S>();
+  CHECK(Near(ElapsedMs(start_ns), 2024, 20));
+  CHECK(Near(SavePower.Now() - start, 2048 + 1024, 20));
+  CHECK(state().timed_sequence_errors == 0);
+}
+
+// Timer0 slowed down by ScaleClockSpeed() : Now() and Delay() stay in real milliseconds, Now() counting by 4ms at clock / 4
+static void TestScaledClockTimekeeping()
+{
+  uint64_t start_ns;
+  uint32_t start;
+  SavePower.ScaleClockSpeed(4);
+  start_ns = state().time_ns;
+  start = SavePower.Now();
+  SavePower.Delay(1000);
+  CHECK(Near(ElapsedMs(start_ns), 1000, 2));
+  CHECK(Near(SavePower.Now() - start, 1000, 5));
+  start_ns = state().time_ns;
+  start = SavePower.Now();
+  SavePower.SleepFor(2000);
+  CHECK(Near(SavePower.Now() - start, ElapsedMs(start_ns), 5));
+  SavePower.ScaleClockSpeed(1);
+  CHECK(state().timed_sequence_errors == 0);
+}
+
+// SleepUntil() reaches the deadline in the deepest mode the constraints allow, keeping the clocks they need
+static void TestSleepUntil()
+{
+  uint32_t deadline = SavePower.Now() + 5000;
+  CHECK(SavePower.SleepUntil(deadline) == MODE_POWER_DOWN);
+  CHECK(Near(SavePower.Now(), deadline, 2));
+  deadline = SavePower.Now() + 300;
+  clear_log();
+  CHECK(SavePower.SleepUntil(deadline, NEED_SPI) == MODE_IDLE);
+  CHECK(Near(SavePower.Now(), deadline, 2));
+  CHECK(NeverSet(ADDRESS_PRR0, (1 << PRSPI)));
+  // A long Idle deadline is timed in full
+  uint64_t start_ns = state().time_ns;
+  deadline = SavePower.Now() + 400000;
+  CHECK(SavePower.SleepUntil(deadline, NEED_USART1) == MODE_IDLE);
+  CHECK(Near(ElapsedMs(start_ns), 400000, 20));
+  CHECK(Near(SavePower.Now(), deadline, 2));
+  // The timers kept by NEED_TIMERS are neither stopped nor gated
+  deadline = SavePower.Now() + 300;
+  clear_log();
+  CHECK(SavePower.SleepUntil(deadline, NEED_TIMERS) == MODE_IDLE);
+  CHECK(Near(SavePower.Now(), deadline, 2));
+  CHECK(NeverSet(ADDRESS_PRR0, (1 << PRTIM0) | (1 << PRTIM1)));
+  CHECK(NeverSet(ADDRESS_PRR1, (1 << PRTIM3) | (1 << PRTIM4)));
+  CHECK(Writes(ADDRESS_TCCR3B).empty());
+}
+
+// SleepMicros() : short and very long durations are timed by the 16-bit timer and added back to millis()
+static void TestSleepMicros()
+{
+  uint64_t start_ns = state().time_ns;
+  uint32_t start;
+  SavePower.SleepMicros(500);
+  CHECK(Near(ElapsedMs(start_ns), 0.5, 0.05));
+  start_ns = state().time_ns;
+  start = SavePower.Now();
+  SavePower.SleepMicros(300000000UL);
+  CHECK(Near(ElapsedMs(start_ns), 300000, 30));
+  CHECK(Near(SavePower.Now() - start, 300000, 2));
+  CHECK(Near(SavePower.Now() - start, ElapsedMs(start_ns), 2));
+  clear_log();
+  SavePower.SleepMicros(2000, SavePowerClass::DomainMask(DOMAIN_SPI, DOMAIN_ADC));
+  CHECK(NeverSet(ADDRESS_PRR0, (1 << PRSPI) | (1 << PRADC)));
+  CHECK(!NeverSet(ADDRESS_PRR0, (1 << PRTWI)));
+  CHECK(state().registers[ADDRESS_PRR0] == 0x00);
+}
+
+// Residency in each mode and wakes per source
+static void TestPowerAccounting()
+{
+  SavePowerStats stats;
+  SavePower.ResetPowerStats();
+  SavePower.SleepFor(5000, MODE_POWER_DOWN);
+  delay(1000);
+  SavePower.SleepFor(2000, MODE_STANDBY);
+  stats = SavePower.GetPowerStats();
+  CHECK(Near(stats.residency_ms[MODE_POWER_DOWN], 5000, 16));
+  CHECK(Near(stats.residency_ms[MODE_STANDBY], 2000, 16));
+  CHECK(Near(stats.residency_ms[MODE_ACTIVE], 1000, 5));
+  CHECK(stats.wakes[WAKE_WATCHDOG] >= 2);
+  CHECK(stats.charge_uAh > 0);
+}
+
+// Reference counted domains : the clock stops with the last user, and the re-initialisation hook runs once it is back
+static void TestPowerDomains()
+{
+  callbacks = 0;
+  SavePower.SetReinitHook(DOMAIN_SPI, Callback);
+  SavePower.AcquireDomain(DOMAIN_SPI);
+  SavePower.AcquireDomain(DOMAIN_SPI);
+  SavePower.ReleaseDomain(DOMAIN_SPI);
+  SavePower.CommitDomains();
+  CHECK(!(state().registers[ADDRESS_PRR0] & (1 << PRSPI)));
+  SavePower.ReleaseDomain(DOMAIN_SPI);
+  SavePower.CommitDomains();
+  CHECK(state().registers[ADDRESS_PRR0] & (1 << PRSPI));
+  CHECK(callbacks == 0);
+  SavePower.AcquireDomain(DOMAIN_SPI);
+  SavePower.CommitDomains();
+  CHECK(!(state().registers[ADDRESS_PRR0] & (1 << PRSPI)));
+  CHECK(callbacks == 1);
+  // The inline methods mark the domains they stop as the out of line ones do, whatever the domain
+  callbacks = 0;
+  SavePower.SetReinitHook(DOMAIN_TIMER1, Callback);
+  SavePower.Disable<DOMAIN_TIMER1>();
+  SavePower.Disable<DOMAIN_TIMER1>();
+  SavePower.Enable<DOMAIN_TIMER1>();
+  SavePower.Enable<DOMAIN_TIMER1>();
+  CHECK(callbacks == 1);
+}
+
+// Registered sources are armed for the sleep only, and LastWakeCause() names the one which fired
+static void TestWakeSources()
+{
+  callbacks = 0;
+  SavePower.AttachWakeSource(WAKE_INT1, Callback, LOW);
+  CHECK(!(state().registers[ADDRESS_EIMSK] & 0x02));
+  schedule_event(300000000ULL, TriggerINT1);
+  SavePower.SleepFor(10000);
+  CHECK(SavePower.LastWakeCause() == (1 << WAKE_INT1));
+  CHECK(callbacks == 1);
+  CHECK(!(state().registers[ADDRESS_EIMSK] & 0x02));
+  SavePower.PowerDownMode(WDTO_120MS);
+  CHECK(SavePower.LastWakeCause() == (1 << WAKE_WATCHDOG));
+  CHECK(SavePower.GetPowerStats().wakes[WAKE_INT1] == 1);
+}
+
+// Serial port standing in for Serial1, bytes arrive from an emulated event
+struct TestPort : Stream
+{
+  std::string sent;
+  int received = 0;
+  int writes = 0;
+  uint8_t prr1_at_write = 0xFF;
+  size_t write(uint8_t value) override { sent += (char)value; writes++; return 1; }
+  size_t write(const uint8_t *buffer, size_t size) override
+  {
+    sent.append((const char *)buffer, size);
+    writes++;
+    prr1_at_write = state().registers[ADDRESS_PRR1];
+    return size;
+  }
+  int available() override { return received; }
+  int read() override { return received ? (received--, 'a') : -1; }
+  int peek() override { return received ? 'a' : -1; }
+};
+
+static TestPort port;
+static void ByteReceived() { port.received++; }
+
+// A Timer0 tick in Idle is not a USART1 reception, a byte is
+static void TestUsartWakeSource()
+{
+  callbacks = 0;
+  SavePower.AttachWakeSource(port, Callback);
+  for (int sleep = 0; sleep < 100; sleep++) SavePower.IdleMode(SLEEP_FOREVER);
+  CHECK(callbacks == 0);
+  CHECK(SavePower.GetPowerStats().wakes[WAKE_USART1] == 0);
+  schedule_event(300000, ByteReceived);
+  for (int sleep = 0; sleep < 3; sleep++) SavePower.IdleMode(SLEEP_FOREVER);
+  CHECK(callbacks == 1);
+  CHECK(SavePower.GetPowerStats().wakes[WAKE_USART1] == 1);
+}
+
+// The Watchdog tick calls back every ticks periods, keeps a SLEEP_FOREVER sleep going, and never resets the MCU
+static void TestWatchdogTick()
+{
+  uint32_t start = SavePower.Now();
+  callbacks = 0;
+  SavePower.StartWatchdogTick(WDTO_1S, 3, Callback);
+  SavePower.AttachWakeSource(WAKE_INT0, 0, LOW);
+  schedule_event(10500000000ULL, TriggerINT0);
+  SavePower.PowerDownMode(SLEEP_FOREVER);
+  CHECK(callbacks == 3);
+  CHECK(SavePower.LastWakeCause() & (1 << WAKE_INT0));
+  CHECK(Near(SavePower.Now() - start, 10240, 2));
+  SavePower.StopWatchdogTick();
+  delay(5000);
+  CHECK(callbacks == 3);
+  CHECK(state().registers[ADDRESS_WDTCSR] == 0x00);
+  CHECK(state().resets == 0);
+  CHECK(state().timed_sequence_errors == 0);
+}
+
+static uint16_t AdcInput(uint8_t mux) { return (mux == 0x20) ? 700 : 100 + mux; }
+
+// One ADC Noise Reduction sleep per conversion, oversampled results in the ring buffer, and the ADC state restored
+static void TestSampleBurst()
+{
+  static const uint8_t channels[] = { 0x00, 0x05, 0x20 };
+  uint16_t value;
+  uint8_t  channel;
+  state().adc_input = AdcInput;
+  PRR0 = 0x01;
+  ADCSRA = 0x07;
+  SavePower.SetSamplingChannels(channels, 3, 0);
+  clear_log();
+  CHECK(SavePower.SampleBurst(6) == 6);
+  CHECK(state().sleeps == 6);
+  CHECK(state().conversions == 6);
+  CHECK(SavePower.SamplesAvailable() == 6);
+  for (int index = 0; index < 6; index++)
+  {
+    CHECK(SavePower.ReadSample(value, channel));
+    CHECK(channel == channels[index % 3]);
+    CHECK(value == AdcInput(channel));
+  }
+  CHECK(!SavePower.ReadSample(value, channel));
+  CHECK(state().registers[ADDRESS_PRR0] == 0x01);
+  CHECK(state().registers[ADDRESS_ADCSRA] == 0x07);
+  CHECK(state().registers[ADDRESS_DIDR0] == 0x00);
+  // 3 oversampling bits : 64 conversions per result of 13 bits, and more than 1023 results
+  SavePower.SetSamplingChannels(channels + 2, 1, 3);
+  state().conversions = 0;
+  SavePower.SampleBurst(1100);
+  CHECK(state().conversions == 1100UL * 64);
+  CHECK(SavePower.ReadSample(value, channel));
+  CHECK(value == 700 * 8);
+}
+
+static uint16_t vcc_mv = 3700;
+static uint16_t BandgapInput(uint8_t mux) { return (mux == 0x1E) ? (uint16_t)(1100UL * 1024 / vcc_mv) : 0; }
+
+// VCC measured against the bandgap, and the battery policy following it
+static void TestVccPolicy()
+{
+  static const SavePowerVccPolicy policy[] = { { 3600, 1, 1, 0 }, { 3300, 2, 2, 0 }, { 3000, 4, 8, (1 << DOMAIN_TWI) } };
+  state().adc_input = BandgapInput;
+  CHECK(Near(SavePower.ReadVcc(), 3700, 20));
+  SavePower.SetVccPolicy(policy, 3, 60000);
+  CHECK(SavePower.UpdateVccPolicy() == &policy[0]);
+  vcc_mv = 3100;
+  SavePower.SetVccPolicy(policy, 3, 60000);
+  CHECK(SavePower.UpdateVccPolicy() == &policy[2]);
+  CHECK(state().registers[ADDRESS_CLKPR] == 0x03);
+  CHECK(state().registers[ADDRESS_PRR0] & (1 << PRTWI));
+  vcc_mv = 3700;
+  SavePower.SetVccPolicy(policy, 3, 60000);
+  CHECK(SavePower.UpdateVccPolicy() == &policy[0]);
+  CHECK(state().registers[ADDRESS_CLKPR] == 0x00);
+  CHECK(state().timed_sequence_errors == 0);
+}
+
+// Replaying the DDRB/PORTB writes : true when a pin of the mask was ever driven to the level opposite to its final one
+static bool PortBGlitch(uint8_t ddr, uint8_t port, uint8_t pins_low, uint8_t pins_high)
+{
+  for (uint16_t index = 0; index < state().log_count; index++)
+  {
+    const Access& access = state().log[index];
+    if (access.type != REGISTER_WRITE) continue;
+    if (access.address == ADDRESS_DDRB) ddr = access.value;
+    else if (access.address == ADDRESS_PORTB) port = access.value;
+    else continue;
+    if ((ddr & pins_low) & port) return true;
+    if ((ddr & pins_high) & ~port) return true;
+  }
+  return false;
+}
+
+// The sleep plan and its restore never drive a pin the wrong way on the way
+static void TestPinSleepPlan()
+{
+  // PB5 (pin 9) output low planned PIN_PULLUP, PB6 (pin 10) output high planned PIN_ANALOG, PB4 (pin 8) output high planned low
+  state().registers[ADDRESS_DDRB] = 0x70;
+  state().registers[ADDRESS_PORTB] = 0x50;
+  SavePower.SetPinSleepPolicy(9, PIN_PULLUP);
+  SavePower.SetPinSleepPolicy(10, PIN_ANALOG);
+  SavePower.SetPinSleepPolicy(8, PIN_OUTPUT_LOW);
+  clear_log();
+  SavePower.ApplyPinSleepPlan();
+  CHECK(state().registers[ADDRESS_DDRB] == 0x10);
+  CHECK(state().registers[ADDRESS_PORTB] == 0x20);
+  CHECK(!PortBGlitch(0x70, 0x50, 0x10, 0x00));
+  CHECK(state().registers[ADDRESS_DIDR2] & 0x20);
+  clear_log();
+  SavePower.RestorePinState();
+  CHECK(state().registers[ADDRESS_DDRB] == 0x70);
+  CHECK(state().registers[ADDRESS_PORTB] == 0x50);
+  CHECK(!PortBGlitch(0x10, 0x20, 0x20, 0x50));
+  CHECK(!(state().registers[ADDRESS_DIDR2] & 0x20));
+}
+
+static void UsbResume() { usb_resume(); }
+
+// A suspended bus is slept through in Power Down with the USB clock frozen and the PLL stopped, both are back on resume
+static void TestUsbSuspend()
+{
+  uint64_t start_ns;
+  CHECK(!SavePower.SleepWhileUsbSuspended());
+  usb_suspend();
+  schedule_event(3600000000000ULL, UsbResume);
+  start_ns = state().time_ns;
+  clear_log();
+  CHECK(SavePower.SleepWhileUsbSuspended());
+  CHECK(Near(ElapsedMs(start_ns), 3600000, 2));
+  CHECK(!NeverSet(ADDRESS_USBCON, (1 << FRZCLK)));
+  CHECK(!(state().registers[ADDRESS_USBCON] & (1 << FRZCLK)));
+  CHECK(state().registers[ADDRESS_PLLCSR] & (1 << PLOCK));
+  CHECK(!SavePower.UsbSuspended());
+  CHECK(state().resets == 0);
+}
+
+// Switching to the RC oscillator and back, refused while USB runs, with the timekeeping and the clock latencies measured
+static void TestClockSource()
+{
+  uint64_t start_ns;
+  uint32_t start;
+  CHECK(!SavePower.SelectClockSource(CLOCK_RC));
+  SavePower.DisableUSB();
+  CHECK(SavePower.SelectClockSource(CLOCK_RC));
+  CHECK(!(state().registers[ADDRESS_CLKSEL0] & (1 << CLKS)));
+  start_ns = state().time_ns;
+  start = SavePower.Now();
+  SavePower.Delay(1000);
+  CHECK(Near(ElapsedMs(start_ns), 1000, 2));
+  CHECK(Near(SavePower.Now() - start, 1000, 2));
+  CHECK(SavePower.SelectClockSource(CLOCK_EXTERNAL));
+  CHECK(state().registers[ADDRESS_CLKSEL0] & (1 << CLKS));
+  CHECK(SavePower.GetClockLatency().crystal_startup_us > 0);
+  CHECK(state().timed_sequence_errors == 0);
+}
+
+static uint8_t log_storage[16];
+
+// The log drains in one burst with USART1 powered up only for it, and before the long sleeps
+static void TestSavePowerLog()
+{
+  SavePowerLog log(port, log_storage, sizeof(log_storage));
+  CHECK(log.Registered());
+  SavePower.Disable<DOMAIN_USART1>();
+  log.print("abcdefghij");
+  CHECK(log.Pending() == 10);
+  CHECK(port.writes == 0);
+  log.print("klm");
+  CHECK(log.Pending() == 0);
+  CHECK(port.sent == "abcdefghijklm");
+  CHECK(port.writes == 1);
+  CHECK(!(port.prr1_at_write & (1 << PRUSART1)));
+  CHECK(state().registers[ADDRESS_PRR1] & (1 << PRUSART1));
+  log.print("xyz");
+  SavePower.PowerDownMode(WDTO_15MS);
+  CHECK(log.Pending() == 3);
+  SavePower.PowerDownMode(WDTO_2S);
+  CHECK(log.Pending() == 0);
+  CHECK(port.sent == "abcdefghijklmxyz");
+}
+
+// Events recorded in RAM, flushed to wear-levelled EEPROM pages, and found again after a new power up
+static void TestPowerTrace()
+{
+  SavePowerTraceEvent event;
+  uint8_t  sleeps = 0;
+  uint8_t  starts = 0;
+  SavePower.ClearTrace();
+  SavePower.StartTrace();
+  SavePower.PowerDownMode(WDTO_1S);
+  while (SavePower.ReadTraceEvent(event))
+  {
+    if (event.type == TRACE_START) starts++;
+    if (event.type == TRACE_SLEEP && event.value == MODE_POWER_DOWN) sleeps++;
+  }
+  CHECK(starts == 1);
+  CHECK(sleeps == 1);
+  SavePower.PowerDownMode(WDTO_1S);
+  CHECK(SavePower.FlushTrace() > 0);
+  CHECK(eeprom().writes > 0);
+  // The page area stays within the EEPROM, and a flush writes the next page
+  uint32_t writes = eeprom().writes;
+  SavePower.PowerDownMode(WDTO_1S);
+  SavePower.FlushTrace();
+  CHECK(eeprom().writes > writes);
+  CHECK(state().resets == 0);
+}
+
+static int task_runs[2];
+static uint32_t task_times[2][8];
+static uint8_t task_prr0[2];
+static void TaskA() { if (task_runs[0] < 8) task_times[0][task_runs[0]] = SavePower.Now(); task_runs[0]++; task_prr0[0] = state().registers[ADDRESS_PRR0]; }
+static void TaskB() { if (task_runs[1] < 8) task_times[1][task_runs[1]] = SavePower.Now(); task_runs[1]++; task_prr0[1] = state().registers[ADDRESS_PRR0]; }
+
+// Close deadlines share a wake up within the slack, each task runs with its domains on, everything else is gated in between
+static void TestTaskScheduler()
+{
+  int wakes = 0;
+  SavePower.AddTask(TaskA, 1000, 200, SavePowerClass::DomainMask(DOMAIN_SPI));
+  SavePower.AddTask(TaskB, 1150, 0, SavePowerClass::DomainMask(DOMAIN_TWI));
+  while (SavePower.Now() < 6000)
+  {
+    SavePower.RunTasks();
+    wakes++;
+    CHECK(state().registers[ADDRESS_PRR0] & ((1 << PRSPI) | (1 << PRTWI)));
+  }
+  CHECK(task_runs[0] == 6);
+  CHECK(task_runs[1] == 6);
+  CHECK(wakes < task_runs[0] + task_runs[1]);
+  // A ran late within its slack to share the wake up of B at 1150
+  CHECK(Near(task_times[0][1], 1150, 2));
+  CHECK(Near(task_times[1][1], 1150, 2));
+  CHECK(!(task_prr0[0] & (1 << PRSPI)));
+  CHECK(!(task_prr0[1] & (1 << PRTWI)));
+  CHECK(SavePower.GetPowerStats().residency_ms[MODE_POWER_DOWN] > 5000);
+  CHECK(state().resets == 0);
+  CHECK(state().timed_sequence_errors == 0);
+}
+
+// The wake up source which ended an earlier sleep does not end the sleeps of RunTasks(), with or without constraints
+static void TestTasksAfterWakeSource()
+{
+  int rounds = 0;
+  SavePower.AttachWakeSource(WAKE_INT0, 0, LOW);
+  schedule_event(500000000ULL, TriggerINT0);
+  SavePower.PowerDownMode(SLEEP_FOREVER);
+  CHECK(SavePower.LastWakeCause() == (1 << WAKE_INT0));
+  SavePower.AddTask(TaskA, 1000, 0, 0, NEED_USART1);
+  while (SavePower.Now() < 3500)
+  {
+    SavePower.RunTasks();
+    rounds++;
+  }
+  CHECK(task_runs[0] == 4);
+  CHECK(rounds < 6);
+  SavePower.RemoveTask(0);
+  schedule_event(500000000ULL, TriggerINT0);
+  SavePower.PowerDownMode(SLEEP_FOREVER);
+  SavePower.AddTask(TaskB, 1000);
+  rounds = 0;
+  while (SavePower.Now() < 7000)
+  {
+    SavePower.RunTasks();
+    rounds++;
+  }
+  CHECK(task_runs[1] == 3);
+  CHECK(rounds < 6);
+  CHECK(state().resets == 0);
+}
+
+static const struct { const char *name; void (*run)(); } tests[] =
+{
+  { "clock-prescaler-sequence", TestClockPrescalerSequence },
+  { "watchdog-sequence", TestWatchdogSequence },
+  { "sleep-mode-sequences", TestSleepModeSequences },
+  { "power-reduction-sequences", TestPowerReductionSequences },
+  { "sleep-template", TestSleepTemplate },
+  { "sleepfor-timekeeping", TestSleepForTimekeeping },
+  { "watchdog-calibration", TestWatchdogCalibration },
+  { "interrupted-period", TestInterruptedPeriod },
+  { "scaled-clock-timekeeping", TestScaledClockTimekeeping },
+  { "sleep-until", TestSleepUntil },
+  { "sleep-micros", TestSleepMicros },
+  { "power-accounting", TestPowerAccounting },
+  { "power-domains", TestPowerDomains },
+  { "wake-sources", TestWakeSources },
+  { "usart-wake-source", TestUsartWakeSource },
+  { "watchdog-tick", TestWatchdogTick },
+  { "sample-burst", TestSampleBurst },
+  { "vcc-policy", TestVccPolicy },
+  { "pin-sleep-plan", TestPinSleepPlan },
+  { "usb-suspend", TestUsbSuspend },
+  { "clock-source", TestClockSource },
+  { "log-buffer", TestSavePowerLog },
+  { "power-trace", TestPowerTrace },
+  { "task-scheduler", TestTaskScheduler },
+  { "tasks-after-wake-source", TestTasksAfterWakeSource },
+};
+
+// Running a test in a child process, on a freshly powered up MCU and library
+static bool RunTest(const char *name, void (*run)())
+{
+  pid_t child;
+  int   status;
+  fflush(stdout);
+  child = fork();
+  if (child == 0)
+  {
+    reset();
+    run();
+    fflush(stdout);
+    _exit(failures ? 1 : 0);
+  }
+  waitpid(child, &status, 0);
+  bool passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  printf("%s %s\n", passed ? "PASS" : "FAIL", name);
+  return passed;
+}
+
+int main(int argc, char **argv)
+{
+  int failed = 0;
+  int ran = 0;
+  for (const auto& test : tests)
+  {
+    bool selected = (argc < 2);
+    for (int arg = 1; arg < argc; arg++) if (!strcmp(argv[arg], test.name)) selected = true;
+    if (!selected) continue;
+    ran++;
+    if (!RunTest(test.name, test.run)) failed++;
+  }
+  printf("%d tests, %d failed\n", ran, failed);
+  return failed;
+}
@@ -0,0 +1,288 @@
+/****************************************************************************************
+* ATMega32U4/16U4 SavePower Library - Power Trace Decoder
+* Host tool (Linux) decoding the power trace pages written to EEPROM by FlushTrace()
+*****************************************************************************************/
+
+/***********************************************************************************************************************************************
+The trace pages are read from a raw dump of the EEPROM, for example made with avrdude :
+
+  avrdude -p m32u4 -c avr109 -P /dev/ttyACM0 -U eeprom:r:eeprom.bin:r
+
+Build and run :
+
+  g++ -std=c++11 -O2 -o SavePowerTraceDecoder SavePowerTraceDecoder.cpp
+  ./SavePowerTraceDecoder eeprom.bin [--start 512] [--pages 8] [--page-size 64] [--current MODE=uA ...] [--quiet]
+
+--start, --pages and --page-size must match SAVEPOWER_TRACE_EEPROM_START, SAVEPOWER_TRACE_PAGES and SAVEPOWER_TRACE_PAGE_SIZE of the sketch
+(the defaults are those of the ATMega32u4, use --start 256 --pages 4 for an ATMega16u4). The valid pages are put back in sequence order,
+and the events are printed as a timeline, split into runs at every StartTrace() (a new power up most of the time). The time between a sleep
+event and the next wake up event is added to the residency of the sleep mode, the rest to the active mode, and the charge is estimated from
+a per mode current table, the same default table as the library. Give the currents measured on the board with --current, MODE being active,
+idle, adc, powerdown, powersave, standby or extstandby.
+
+Take note that :
+  ===> A run ending in a sleep mode ends with its last event : the unit was reset or lost power during the sleep, or the events after it
+       were not flushed.
+  ===> The events lost because the RAM buffer of the trace was full are reported in front of the first event following them, and end
+       the run : the time they span is not accounted.
+***********************************************************************************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+// Layout of a trace page, as written by FlushTrace()
+static const unsigned PAGE_HEADER = 5;
+static const unsigned EVENT_BYTES = 6;
+
+// Event types (Trace_Event_Value), wake up sources (Wake_Source_Value) and sleep modes (Sleep_Mode_Value) of SavePower.h
+enum { TRACE_START, TRACE_SLEEP, TRACE_WAKE, TRACE_PRR0, TRACE_PRR1, TRACE_CLOCK };
+static const uint8_t TRACE_WAKE_TIMER = 0xFF;
+static const unsigned MODES = 7;
+static const unsigned MODE_ACTIVE = 6;
+
+static const char *mode_names[MODES] = { "idle", "adc", "powerdown", "powersave", "standby", "extstandby", "active" };
+static const char *mode_titles[MODES] = { "Idle", "ADC Noise Reduction", "Power Down", "Power Save", "Standby", "Extended Standby",
+                                          "Active" };
+static const char *wake_names[] = { "Watchdog", "interrupt", "INT0", "INT1", "INT2", "INT3", "INT6", "PCINT0-7", "USB resume", "USART1" };
+
+// Default current per mode in uA, as the library
+static double mode_current_uA[MODES] = { 4000, 1500, 10, 10, 300, 300, 10000 };
+
+struct TraceEvent
+{
+  uint32_t time_ms;
+  uint8_t  type;
+  uint8_t  value;
+  unsigned lost;
+};
+
+struct TracePage
+{
+  uint16_t sequence;
+  std::vector<TraceEvent> events;
+};
+
+// Same checksum as the library : rotate and xor over the page, checksum byte excluded
+static uint8_t PageChecksum(const uint8_t *page, unsigned count)
+{
+  uint8_t checksum = 0x5A;
+  for (unsigned index = 0; index < PAGE_HEADER + count * EVENT_BYTES; index++)
+  {
+    if (index == PAGE_HEADER - 1) continue;
+    checksum = (uint8_t)((checksum << 1) | (checksum >> 7)) ^ page[index];
+  }
+  return checksum;
+}
+
+// Valid pages of the dump, in the order they were written
+static std::vector<TracePage> ReadPages(const std::vector<uint8_t> &dump, unsigned start, unsigned pages, unsigned page_size)
+{
+  std::vector<TracePage> result;
+  unsigned capacity = (page_size - PAGE_HEADER) / EVENT_BYTES;
+  for (unsigned index = 0; index < pages; index++)
+  {
+    const uint8_t *page = &dump[start + index * page_size];
+    unsigned count = page[2];
+    if (count == 0 || count > capacity || PageChecksum(page, count) != page[PAGE_HEADER - 1]) continue;
+    TracePage decoded;
+    decoded.sequence = page[0] | (page[1] << 8);
+    for (unsigned event = 0; event < count; event++)
+    {
+      const uint8_t *bytes = page + PAGE_HEADER + event * EVENT_BYTES;
+      TraceEvent decoded_event;
+      decoded_event.time_ms = bytes[0] | (bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+      decoded_event.type = bytes[4];
+      decoded_event.value = bytes[5];
+      decoded_event.lost = (event == 0) ? page[3] : 0;
+      decoded.events.push_back(decoded_event);
+    }
+    result.push_back(decoded);
+  }
+  // The sequence number wraps around : the oldest page is the one following the largest gap
+  std::sort(result.begin(), result.end(), [](const TracePage &a, const TracePage &b) { return a.sequence < b.sequence; });
+  if (result.size() > 1)
+  {
+    size_t oldest = 0;
+    unsigned largest_gap = (uint16_t)(result[0].sequence - result.back().sequence);
+    for (size_t index = 1; index < result.size(); index++)
+    {
+      unsigned gap = (uint16_t)(result[index].sequence - result[index - 1].sequence);
+      if (gap > largest_gap)
+      {
+        largest_gap = gap;
+        oldest = index;
+      }
+    }
+    std::rotate(result.begin(), result.begin() + oldest, result.end());
+  }
+  return result;
+}
+
+static void PrintResetFlags(uint8_t flags)
+{
+  static const char *names[] = { "power-on", "external", "brown-out", "watchdog", "JTAG" };
+  bool first = true;
+  printf("reset flags 0x%02X", flags);
+  for (unsigned bit = 0; bit < 5; bit++)
+  {
+    if (!(flags & (1 << bit))) continue;
+    printf("%s%s", first ? " : " : ", ", names[bit]);
+    first = false;
+  }
+}
+
+static void PrintEvent(const TraceEvent &event)
+{
+  printf("  %10lu.%03lu s  ", (unsigned long)(event.time_ms / 1000), (unsigned long)(event.time_ms % 1000));
+  switch (event.type)
+  {
+    case TRACE_START:
+      printf("trace started, ");
+      PrintResetFlags(event.value);
+      break;
+    case TRACE_SLEEP:
+      printf("sleep  %s", event.value < MODE_ACTIVE ? mode_titles[event.value] : "unknown mode");
+      break;
+    case TRACE_WAKE:
+      if (event.value == TRACE_WAKE_TIMER) printf("wake   end of SleepMicros()");
+      else printf("wake   %s", event.value < sizeof(wake_names) / sizeof(wake_names[0]) ? wake_names[event.value] : "unknown source");
+      break;
+    case TRACE_PRR0:
+    case TRACE_PRR1:
+      printf("PRR%u   0x%02X", event.type == TRACE_PRR0 ? 0 : 1, event.value);
+      break;
+    case TRACE_CLOCK:
+      printf("clock  F_CPU / %u (%s)", 1u << (event.value & 0x0F), (event.value & 0x80) ? "RC oscillator" : "external");
+      break;
+    default:
+      printf("unknown event %u (0x%02X)", event.type, event.value);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = 0;
+  unsigned start = 512;
+  unsigned pages = 8;
+  unsigned page_size = 64;
+  bool     quiet = false;
+  for (int arg = 1; arg < argc; arg++)
+  {
+    if (!strcmp(argv[arg], "--start") && arg + 1 < argc) start = strtoul(argv[++arg], 0, 0);
+    else if (!strcmp(argv[arg], "--pages") && arg + 1 < argc) pages = strtoul(argv[++arg], 0, 0);
+    else if (!strcmp(argv[arg], "--page-size") && arg + 1 < argc) page_size = strtoul(argv[++arg], 0, 0);
+    else if (!strcmp(argv[arg], "--quiet")) quiet = true;
+    else if (!strcmp(argv[arg], "--current") && arg + 1 < argc)
+    {
+      const char *setting = argv[++arg];
+      const char *equal = strchr(setting, '=');
+      unsigned mode = 0;
+      while (equal && mode < MODES && strncmp(setting, mode_names[mode], equal - setting)) mode++;
+      if (!equal || mode == MODES)
+      {
+        fprintf(stderr, "Unknown mode in --current %s\n", setting);
+        return 1;
+      }
+      mode_current_uA[mode] = strtod(equal + 1, 0);
+    }
+    else if (argv[arg][0] != '-' && !path) path = argv[arg];
+    else
+    {
+      fprintf(stderr, "Usage : %s eeprom.bin [--start 512] [--pages 8] [--page-size 64] [--current MODE=uA ...] [--quiet]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (!path)
+  {
+    fprintf(stderr, "Usage : %s eeprom.bin [--start 512] [--pages 8] [--page-size 64] [--current MODE=uA ...] [--quiet]\n", argv[0]);
+    return 1;
+  }
+  if (page_size <= PAGE_HEADER + EVENT_BYTES)
+  {
+    fprintf(stderr, "The page size must hold at least one event\n");
+    return 1;
+  }
+
+  FILE *file = fopen(path, "rb");
+  if (!file)
+  {
+    perror(path);
+    return 1;
+  }
+  std::vector<uint8_t> dump;
+  uint8_t chunk[256];
+  size_t  size;
+  while ((size = fread(chunk, 1, sizeof(chunk), file)) > 0) dump.insert(dump.end(), chunk, chunk + size);
+  fclose(file);
+  if (dump.size() < start + pages * page_size)
+  {
+    fprintf(stderr, "%s holds %u bytes, the trace area ends at %u\n", path, (unsigned)dump.size(), start + pages * page_size);
+    return 1;
+  }
+
+  std::vector<TracePage> trace = ReadPages(dump, start, pages, page_size);
+  if (trace.empty())
+  {
+    printf("No valid trace page\n");
+    return 0;
+  }
+
+  // Timeline and residency : a run starts at every TRACE_START, or when the time goes backwards
+  double   residency_ms[MODES] = { 0 };
+  unsigned mode = MODE_ACTIVE;
+  unsigned runs = 0;
+  unsigned lost = 0;
+  bool     running = false;
+  uint32_t last_ms = 0;
+  if (!quiet) printf("Timeline (%u pages, sequence %u to %u)\n", (unsigned)trace.size(), trace.front().sequence, trace.back().sequence);
+  for (const TracePage &page : trace)
+  {
+    for (const TraceEvent &event : page.events)
+    {
+      if (event.lost)
+      {
+        lost += event.lost;
+        if (!quiet) printf("  ... %u events lost (RAM buffer full)\n", event.lost);
+      }
+      // Nothing is known of the time spent during lost events : they end the run as well
+      if (event.type == TRACE_START || !running || event.time_ms < last_ms || event.lost)
+      {
+        if (running && mode != MODE_ACTIVE && !quiet) printf("  run ended in %s\n", mode_titles[mode]);
+        runs++;
+        running = true;
+        mode = MODE_ACTIVE;
+        last_ms = event.time_ms;
+        if (!quiet) printf("Run %u\n", runs);
+      }
+      residency_ms[mode] += event.time_ms - last_ms;
+      last_ms = event.time_ms;
+      if (event.type == TRACE_SLEEP && event.value < MODE_ACTIVE) mode = event.value;
+      else if (event.type == TRACE_WAKE) mode = MODE_ACTIVE;
+      if (!quiet) PrintEvent(event);
+    }
+  }
+  if (mode != MODE_ACTIVE && !quiet) printf("  run ended in %s\n", mode_titles[mode]);
+
+  // Residency and charge estimate
+  double total_ms = 0;
+  double charge_uAh = 0;
+  for (unsigned index = 0; index < MODES; index++) total_ms += residency_ms[index];
+  printf("\nResidency over %u run(s), %.3f s traced%s\n", runs, total_ms / 1000.0, lost ? " (some events lost)" : "");
+  for (unsigned index = MODES; index-- > 0;)
+  {
+    double uAh = residency_ms[index] * mode_current_uA[index] / 3600000.0;
+    if (residency_ms[index] == 0) continue;
+    charge_uAh += uAh;
+    printf("  %-20s %12.3f s  %6.2f %%  %10.3f uAh  (%g uA)\n", mode_titles[index], residency_ms[index] / 1000.0,
+           total_ms ? residency_ms[index] * 100.0 / total_ms : 0.0, uAh, mode_current_uA[index]);
+  }
+  printf("Estimated charge   %.3f uAh", charge_uAh);
+  if (total_ms > 0) printf(", average current %.1f uA", charge_uAh * 3600000.0 / total_ms);
+  printf("\n");
+  return 0;
+}